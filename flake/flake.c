@@ -72,7 +72,14 @@ print_help(FILE *out)
                  "                        9 = -b 4096 -t 2 -l 12  -m 6 -r 8 -s 1 -v 1\n"
                  "                       10 = -b 4096 -t 2 -l 12  -m 5 -r 8 -s 1 -v 1\n"
                  "                       11 = -b 8192 -t 2 -l 32  -m 6 -r 8 -s 1 -v 1\n"
-                 "                       12 = -b 8192 -t 2 -l 32  -m 5 -r 8 -s 1 -v 1\n"
+                 "                       12 = -b 8192 -t 2 -l 32  -m 5 -r 8 -s 2 -v 1\n"
+                 "       [-c #]       Choose the compression level from a first pass over\n"
+                 "                    parts of the input. The fastest Subset level whose\n"
+                 "                    size is within # tenths of a percent of the\n"
+                 "                    smallest is used. Needs a seekable input.\n"
+                 "       [-e #[,#]]   Also encode at these compression levels, sharing\n"
+                 "                    the input and analysis.  Each is written next to\n"
+                 "                    the output file, with \"-#\" added to its name.\n"
                  "       [-b #]       Block size [16 - 65535] (default: 4096)\n"
                  "       [-t #]       Prediction type\n"
                  "                        0 = no prediction / verbatim\n"
@@ -87,13 +94,37 @@ print_help(FILE *out)
                  "                        4 = 8-level\n"
                  "                        5 = full search\n"
                  "                        6 = log search\n"
+                 "                        7 = model-based search\n"
+                 "       [-f #]       Fixed-prediction screen before LPC analysis\n"
+                 "                        0 = disabled (default)\n"
+                 "                        1 to 100 = skip LPC if its expected gain is\n"
+                 "                                   below # tenths of a percent of\n"
+                 "                                   the fixed size\n"
+                 "       [-w #[,#]]   LPC apodization windows {mask} or {mask},{tukey %%}\n"
+                 "                        1 = Welch (default)\n"
+                 "                        2 = Hann\n"
+                 "                        4 = Tukey (default taper: 50%%)\n"
+                 "                        8 = partial Tukey\n"
+                 "                        windows can be combined by adding values\n"
+                 "       [-a #]       LPC analysis precision\n"
+                 "                        0 = double (default)\n"
+                 "                        1 = single (faster)\n"
                  "       [-r #[,#]]   Rice partition order {max} or {min},{max} (default: 0,5)\n"
                  "       [-s #]       Stereo decorrelation method\n"
                  "                        0 = independent L+R channels\n"
-                 "                        1 = mid-side (default)\n"
+                 "                        1 = mid-side, estimated (default)\n"
+                 "                        2 = mid-side, encode all and pick smallest\n"
                  "       [-v #]       Variable block size\n"
                  "                        0 = fixed (default)\n"
-                 "                        1 = variable\n"
+                 "                        1 = variable, heuristic split\n"
+                 "                        2 = variable, search all aligned splits\n"
+                 "       [-d #]       Low-latency profile. 256-sample frames with bounded\n"
+                 "                    analysis, each written as soon as it is encoded.\n"
+                 "                        0 = off (default)\n"
+                 "                        1 = on\n"
+                 "       [-x #]       Target speed, as a multiple of realtime. Compression\n"
+                 "                    levels up to the one chosen are used as time allows.\n"
+                 "                        0 = fixed parameters (default)\n"
                  "\n");
 }
 
@@ -119,6 +150,15 @@ typedef struct CommandOptions {
     int stmethod;
     int padding;
     int vbs;
+    int fscreen;
+    int apod;
+    int tukey;
+    int aprec;
+    int tspeed;
+    int lowlat;
+    int autotol;
+    int extra[FLAKE_MAX_OUTPUTS];
+    int extra_count;
     int quiet;
 } CommandOptions;
 
@@ -150,7 +190,8 @@ static int
 parse_commandline(int argc, char **argv, CommandOptions *opts)
 {
     int i;
-    static const char *param_str = "bhlmopqrstv";
+    static const char *param_str = "abcdefhlmopqrstvwx";
+    char *pe, *pn;
     int max_digits = 8;
     int ifc = 0;
 
@@ -173,6 +214,14 @@ parse_commandline(int argc, char **argv, CommandOptions *opts)
     opts->stmethod = -1;
     opts->padding = -1;
     opts->vbs = -1;
+    opts->fscreen = -1;
+    opts->aprec = -1;
+    opts->apod = -1;
+    opts->tukey = -1;
+    opts->tspeed = -1;
+    opts->lowlat = -1;
+    opts->autotol = -1;
+    opts->extra_count = 0;
     opts->quiet = 0;
 
     for(i=1; i<argc; i++) {
@@ -209,10 +258,40 @@ parse_commandline(int argc, char **argv, CommandOptions *opts)
                 }
 
                 switch(argv[i-1][1]) {
+                    case 'a':
+                        opts->aprec = parse_number(argv[i], max_digits);
+                        if(opts->aprec < 0) return 1;
+                        break;
+                    case 'c':
+                        opts->autotol = parse_number(argv[i], max_digits);
+                        if(opts->autotol < 0) return 1;
+                        break;
+                    case 'e':
+                        for(pe = argv[i]; pe; pe = pn) {
+                            pn = strchr(pe, ',');
+                            if(pn) *pn++ = '\0';
+                            if(opts->extra_count >= FLAKE_MAX_OUTPUTS) {
+                                fprintf(stderr, "too many extra outputs\n");
+                                return 1;
+                            }
+                            opts->extra[opts->extra_count] = parse_number(pe, max_digits);
+                            if(opts->extra[opts->extra_count] < 0 ||
+                               opts->extra[opts->extra_count] > 12) return 1;
+                            opts->extra_count++;
+                        }
+                        break;
+                    case 'd':
+                        opts->lowlat = parse_number(argv[i], max_digits);
+                        if(opts->lowlat < 0) return 1;
+                        break;
                     case 'b':
                         opts->bsize = parse_number(argv[i], max_digits);
                         if(opts->bsize < 0) return 1;
                         break;
+                    case 'f':
+                        opts->fscreen = parse_number(argv[i], max_digits);
+                        if(opts->fscreen < 0) return 1;
+                        break;
                     case 'l':
                         if(strchr(argv[i], ',') == NULL) {
                             opts->omax = parse_number(argv[i], max_digits);
@@ -274,6 +353,23 @@ parse_commandline(int argc, char **argv, CommandOptions *opts)
                         opts->vbs = parse_number(argv[i], max_digits);
                         if(opts->vbs < 0) return 1;
                         break;
+                    case 'w':
+                        if(strchr(argv[i], ',') == NULL) {
+                            opts->apod = parse_number(argv[i], max_digits);
+                            if(opts->apod < 0) return 1;
+                        } else {
+                            char *po = strchr(argv[i], ',');
+                            po[0] = '\0';
+                            opts->apod = parse_number(argv[i], max_digits);
+                            if(opts->apod < 0) return 1;
+                            opts->tukey = parse_number(&po[1], max_digits);
+                            if(opts->tukey < 0) return 1;
+                        }
+                        break;
+                    case 'x':
+                        opts->tspeed = parse_number(argv[i], max_digits);
+                        if(opts->tspeed < 0) return 1;
+                        break;
                 }
             }
         } else {
@@ -321,12 +417,207 @@ parse_commandline(int argc, char **argv, CommandOptions *opts)
     return 0;
 }
 
+static void
+print_progress(FlakeContext *s, uint64_t samplecount, uint64_t bytecount,
+               int block_align)
+{
+    int percent;
+    float kb, sec, kbps, wav_bytes;
+
+    if(!samplecount)
+        return;
+    kb = ((bytecount * 8.0) / 1000.0);
+    sec = ((float)samplecount) / ((float)s->sample_rate);
+    kbps = kb / sec;
+    percent = 0;
+    if(s->samples > 0) {
+        percent = ((samplecount * 100.5) / s->samples);
+    }
+    wav_bytes = samplecount * block_align;
+    fprintf(stderr, "\rprogress: %3d%% | ratio: %1.3f | bitrate: %4.1f kbps ",
+            percent, (bytecount / wav_bytes), kbps);
+}
+
+/**
+ * Frame callback for low-latency mode: write each frame as soon as it is
+ * encoded.
+ */
+static int
+write_frame_flush(void *opaque, const unsigned char *data, int size)
+{
+    FILE *ofp = opaque;
+
+    if(fwrite(data, size, 1, ofp) != 1 || fflush(ofp))
+        return -1;
+    return 0;
+}
+
+/** size of the buffer collecting frames for each write to an output file */
+#define OUTPUT_BUFFER_SIZE (1<<18)
+
+/**
+ * Sink callback writing the collected frames to a file
+ */
+static int
+write_frame_file(void *opaque, const unsigned char *data, int size)
+{
+    FILE *ofp = opaque;
+
+    if(fwrite(data, size, 1, ofp) != 1)
+        return -1;
+    return 0;
+}
+
+/**
+ * Sink callback used to rewrite STREAMINFO
+ */
+static int
+seek_file(void *opaque, uint64_t pos)
+{
+    FILE *ofp = opaque;
+
+    if(fflush(ofp) || fseek(ofp, (long)pos, SEEK_SET))
+        return -1;
+    return 0;
+}
+
+/**
+ * Send the encoded frames to a file.  Frames are collected in a large buffer
+ * and written together, except in low-latency mode, where each frame is
+ * written and flushed as soon as it is encoded.  The buffer is returned to
+ * be freed by the caller after the encoder is closed.
+ */
+static int
+set_file_sink(FlakeContext *s, FILE *ofp, uint8_t **buffer)
+{
+    FlakeOutputSink sink;
+
+    memset(&sink, 0, sizeof(FlakeOutputSink));
+    sink.write = write_frame_file;
+    // a pipe cannot seek, so STREAMINFO is not rewritten
+    if(!fseek(ofp, 0, SEEK_CUR))
+        sink.seek = seek_file;
+    sink.opaque = ofp;
+    *buffer = NULL;
+    if(s->params.low_latency) {
+        sink.write = write_frame_flush;
+    } else {
+        sink.buffer_size = MAX(flake_get_buffer_size(s), OUTPUT_BUFFER_SIZE);
+        sink.buffer = malloc(sink.buffer_size);
+        if(!sink.buffer)
+            return -1;
+        *buffer = sink.buffer;
+    }
+    return flake_set_output_sink(s, &sink);
+}
+
+/**
+ * Write the frames left in the sink buffer and, if seeking is possible,
+ * rewrite the streaminfo metadata header
+ */
+static void
+finish_output(FlakeContext *s)
+{
+    if(flake_finish_output(s) < 0)
+        fprintf(stderr, "\nError writing to output\n");
+}
+
+typedef struct ExtraOutput {
+    FlakeContext s;
+    char *outfile;
+    FILE *ofp;
+    uint8_t *buffer;
+    uint64_t bytecount;
+} ExtraOutput;
+
+/**
+ * Set up an extra output at another compression level, named after the
+ * main output file with "-<level>" added before the extension.
+ */
+static int
+open_extra(CommandOptions *opts, FlakeContext *s, FilePair *files,
+           ExtraOutput *x, int level)
+{
+    int len, ext, header_size;
+
+    memset(x, 0, sizeof(ExtraOutput));
+    x->s.channels = s->channels;
+    x->s.sample_rate = s->sample_rate;
+    x->s.bits_per_sample = s->bits_per_sample;
+    x->s.samples = s->samples;
+    x->s.params.compression = level;
+    if(flake_set_defaults(&x->s.params))
+        return 1;
+    if(opts->padding >= 0) x->s.params.padding_size = opts->padding;
+
+    len = strlen(files->outfile);
+    ext = len;
+    if(len > 5 && !strcmp(&files->outfile[len-5], ".flac"))
+        ext = len - 5;
+    x->outfile = calloc(1, len + 12);
+    if(!x->outfile)
+        return 1;
+    memcpy(x->outfile, files->outfile, ext);
+    sprintf(&x->outfile[ext], "-%d.flac", level);
+    x->ofp = fopen(x->outfile, "wb");
+    if(!x->ofp) {
+        fprintf(stderr, "error opening output file: %s\n", x->outfile);
+        return 1;
+    }
+
+    header_size = flake_encode_init(&x->s);
+    if(header_size < 0) {
+        fprintf(stderr, "Error initializing encoder.\n");
+        return 1;
+    }
+    if(set_file_sink(&x->s, x->ofp, &x->buffer)) {
+        fprintf(stderr, "Error setting output: %s\n", x->outfile);
+        return 1;
+    }
+    if(flake_add_output(s, &x->s)) {
+        fprintf(stderr, "Error adding output: %s\n", x->outfile);
+        return 1;
+    }
+    if (fwrite(x->s.header, header_size, 1, x->ofp) != 1) {
+        fprintf(stderr, "\nError writing header to output\n");
+    }
+    x->bytecount = header_size;
+    return 0;
+}
+
+static void
+close_extra(ExtraOutput *x, int quiet)
+{
+    FlakeEncodeStats stats;
+
+    if(x->ofp) {
+        if(x->s.private_ctx) {
+            finish_output(&x->s);
+            if(!quiet && !flake_get_stats(&x->s, &stats)) {
+                fprintf(stderr, "output file: \"%s\" (level %d) | bytes: %"PRIu64"\n",
+                        x->outfile, x->s.params.compression,
+                        x->bytecount + stats.bytes);
+            }
+        }
+        fclose(x->ofp);
+    }
+    flake_encode_close(&x->s);
+    free(x->buffer);
+    free(x->outfile);
+}
+
 static void
 print_params(FlakeContext *s)
 {
-    char *omethod_s, *stmethod_s, *ptype_s;
+    char *omethod_s, *stmethod_s, *ptype_s, *vbs_s;
 
-    fprintf(stderr, "variable block size: %s\n", s->params.variable_block_size?"yes":"no");
+    vbs_s = "ERROR";
+    switch(s->params.variable_block_size) {
+        case 0: vbs_s = "no";                break;
+        case 1: vbs_s = "yes (heuristic)";   break;
+        case 2: vbs_s = "yes (search)";      break;
+    }
+    fprintf(stderr, "variable block size: %s\n", vbs_s);
     ptype_s = "ERROR";
     switch(s->params.prediction_type) {
         case 0: ptype_s = "none (verbatim mode)";  break;
@@ -348,20 +639,85 @@ print_params(FlakeContext *s)
             case 4: omethod_s = "8-level"; break;
             case 5: omethod_s = "full search";   break;
             case 6: omethod_s = "log search";  break;
+            case 7: omethod_s = "model search"; break;
         }
         fprintf(stderr, "order method: %s\n", omethod_s);
+        if(s->params.prediction_type == FLAKE_PREDICTION_LEVINSON) {
+            int apod = s->params.apodization;
+            if(!apod) apod = FLAKE_WINDOW_WELCH;
+            fprintf(stderr, "windows:%s%s%s%s\n",
+                    (apod & FLAKE_WINDOW_WELCH) ? " welch" : "",
+                    (apod & FLAKE_WINDOW_HANN)  ? " hann"  : "",
+                    (apod & FLAKE_WINDOW_TUKEY) ? " tukey" : "",
+                    (apod & FLAKE_WINDOW_PARTIAL_TUKEY) ? " partial-tukey" : "");
+            if(apod & (FLAKE_WINDOW_TUKEY | FLAKE_WINDOW_PARTIAL_TUKEY)) {
+                fprintf(stderr, "tukey taper: %d%%\n", s->params.tukey_p);
+            }
+            if(s->params.fixed_screen > 0) {
+                fprintf(stderr, "fixed screen: %d.%d%%\n",
+                        s->params.fixed_screen / 10,
+                        s->params.fixed_screen % 10);
+            }
+            fprintf(stderr, "analysis precision: %s\n",
+                    s->params.float_analysis ? "single" : "double");
+        }
     }
     if(s->channels == 2) {
         stmethod_s = "ERROR";
         switch(s->params.stereo_method) {
             case 0: stmethod_s = "independent";  break;
             case 1: stmethod_s = "mid-side";     break;
+            case 2: stmethod_s = "mid-side, exact"; break;
         }
         fprintf(stderr, "stereo method: %s\n", stmethod_s);
     }
+    if(s->params.target_speed > 0) {
+        fprintf(stderr, "target speed: %dx realtime\n", s->params.target_speed);
+    }
+    if(s->params.low_latency) {
+        fprintf(stderr, "low latency: yes\n");
+    }
     fprintf(stderr, "header padding: %d\n", s->params.padding_size);
 }
 
+/**
+ * Print the frame latency percentiles
+ */
+static void
+print_latency_stats(FlakeContext *s)
+{
+    FlakeEncodeStats st;
+
+    if(flake_get_stats(s, &st) || !st.frames)
+        return;
+    fprintf(stderr, "frame latency: p50 %.0f us | p99 %.0f us | "
+                    "block duration: %.1f ms\n\n",
+            flake_get_latency(&st, 50.0), flake_get_latency(&st, 99.0),
+            1000.0 * s->params.block_size / s->sample_rate);
+}
+
+/**
+ * Print the share of frames encoded at each compression level
+ */
+static void
+print_speed_stats(FlakeContext *s)
+{
+    int i;
+    FlakeEncodeStats st;
+
+    if(flake_get_stats(s, &st) || !st.frames || st.encode_time <= 0)
+        return;
+    fprintf(stderr, "speed: %.1fx realtime | levels:",
+            st.samples / (st.encode_time * s->sample_rate));
+    for(i=0; i<13; i++) {
+        if(st.level_frames[i]) {
+            fprintf(stderr, " %d:%.1f%%", i,
+                    100.0 * st.level_frames[i] / st.frames);
+        }
+    }
+    fprintf(stderr, "\n\n");
+}
+
 #if HAVE_LIBSNDFILE
 typedef SNDFILE PcmContext;
 typedef SF_INFO PcmInfo;
@@ -387,7 +743,7 @@ pcm_init_sndfile(PcmContext **ctx, PcmInfo *info, FILE *ifp, FlakeContext *s)
             sf_close(*ctx);
             return -1;
     }
-    s->samples = MIN(info->frames, UINT32_MAX);
+    s->samples = MAX(info->frames, 0);
     return 0;
 }
 
@@ -405,7 +761,7 @@ pcm_init_pcmio(PcmContext *ctx, FILE *ifp, FlakeContext *s)
     s->channels = ctx->channels;
     s->sample_rate = ctx->sample_rate;
     s->bits_per_sample = ctx->bit_width;
-    s->samples = MIN(ctx->samples, UINT32_MAX);
+    s->samples = ctx->samples;
     return 0;
 }
 
@@ -492,18 +848,243 @@ sndfile_print(SF_INFO *info, FILE *st)
 
 #endif
 
+static int
+pcm_read_samples(PcmContext *ctx, int32_t *wav, FlakeContext *s, int samples)
+{
+#if HAVE_LIBSNDFILE
+    return sndfile_read_samples(ctx, wav, s->bits_per_sample, s->channels,
+                                samples);
+#else
+    (void)s;
+    return pcmfile_read_samples(ctx, wav, samples);
+#endif
+}
+
+/**
+ * Switch 9 to 16-bit input to reading packed int16 samples, which the encoder
+ * widens as it copies them.  Returns 1 if the input is read that way.
+ */
+static int
+pcm_use_s16(PcmContext *ctx, FlakeContext *s)
+{
+    if(s->bits_per_sample <= 8 || s->bits_per_sample > 16)
+        return 0;
+#if HAVE_LIBSNDFILE
+    (void)ctx;
+#else
+    pcmfile_set_read_format(ctx, PCM_DATA_FORMAT_S16);
+#endif
+    return 1;
+}
+
+/**
+ * Keep reading seekable input while frames are encoded.  Pipes are left
+ * unbuffered, so live and low-latency input is encoded as it arrives.
+ */
+static void
+pcm_read_ahead(PcmContext *ctx, FlakeContext *s)
+{
+#if HAVE_LIBSNDFILE
+    (void)ctx;
+    (void)s;
+#else
+    // a no-op for mapped files
+    if(ctx->seekable && !s->params.low_latency)
+        pcmfile_set_read_ahead(ctx, 0, 0);
+#endif
+}
+
+static int
+pcm_read_s16(PcmContext *ctx, int16_t *wav, int samples)
+{
+#if HAVE_LIBSNDFILE
+    return sf_readf_short(ctx, wav, samples);
+#else
+    return pcmfile_read_samples(ctx, wav, samples);
+#endif
+}
+
+/**
+ * Read and encode one frame of input.  Returns the number of samples read,
+ * with the frame size or -1 in *fs.
+ */
+static int
+encode_next_frame(PcmContext *ctx, FlakeContext *s, int32_t *wav, int s16,
+                  int *fs)
+{
+    int nr;
+
+    *fs = 0;
+    if(s16) {
+        nr = pcm_read_s16(ctx, (int16_t *)wav, s->params.block_size);
+        if(nr > 0)
+            *fs = flake_encode_frame_s16(s, (const short *)wav, nr);
+    } else {
+        nr = pcm_read_samples(ctx, wav, s, s->params.block_size);
+        if(nr > 0)
+            *fs = flake_encode_frame(s, wav, nr);
+    }
+    return nr;
+}
+
+/**
+ * Seek to an absolute sample position.  Returns -1 if the input cannot seek.
+ */
+static int
+pcm_seek(PcmContext *ctx, PcmInfo *info, uint64_t pos)
+{
+#if HAVE_LIBSNDFILE
+    if(!info->seekable)
+        return -1;
+    return (sf_seek(ctx, pos, SEEK_SET) < 0) ? -1 : 0;
+#else
+    (void)info;
+    if(!ctx->seekable)
+        return -1;
+    return pcmfile_seek_samples(ctx, pos, PCM_SEEK_SET);
+#endif
+}
+
+#define AUTO_REGIONS    4
+#define AUTO_REGION_MS  1500
+#define AUTO_MIN_SAMPLES 4096
+
+typedef struct AutoResult {
+    int level;
+    uint32_t bytes;
+    double time;
+} AutoResult;
+
+/**
+ * Encode the sampled audio at one compression level.
+ * Returns -1 if the level is outside of the FLAC Subset or fails.
+ */
+static int
+auto_encode(FlakeContext *s, int level, const int32_t *wav, int samples,
+            AutoResult *res)
+{
+    FlakeContext t;
+    FlakeEncodeStats st;
+    int i, nr;
+
+    memset(&t, 0, sizeof(FlakeContext));
+    t.channels = s->channels;
+    t.sample_rate = s->sample_rate;
+    t.bits_per_sample = s->bits_per_sample;
+    t.params.compression = level;
+    if(flake_set_defaults(&t.params) || flake_validate_params(&t) != 0)
+        return -1;
+    if(flake_encode_init(&t) < 0) {
+        flake_encode_close(&t);
+        return -1;
+    }
+    for(i=0; i<samples; i+=nr) {
+        nr = MIN(t.params.block_size, samples-i);
+        if(flake_encode_frame(&t, &wav[i*t.channels], nr) < 0) {
+            flake_encode_close(&t);
+            return -1;
+        }
+    }
+    flake_get_stats(&t, &st);
+    flake_encode_close(&t);
+
+    res->level = level;
+    res->bytes = (uint32_t)st.bytes;
+    res->time = st.encode_time;
+    return 0;
+}
+
+/**
+ * Choose a compression level from a first pass over a few regions of the
+ * input.  Every level within the FLAC Subset is tried, and levels which are
+ * both slower and larger than another are discarded.  Of the rest, the
+ * fastest whose size is within tol tenths of a percent of the smallest is
+ * chosen.  Returns -1 if the input is not seekable or its length is unknown.
+ */
+static int
+choose_auto_level(PcmContext *ctx, PcmInfo *info, FlakeContext *s, int tol,
+                  int quiet)
+{
+    AutoResult res[13];
+    int32_t *wav;
+    uint32_t len, best_bytes;
+    uint64_t pos;
+    int i, n, nr, lvl, count, best;
+
+    if(!s->samples || pcm_seek(ctx, info, 0))
+        return -1;
+
+    // sample regions spread evenly across the input
+    len = (uint32_t)((uint64_t)s->sample_rate * AUTO_REGION_MS / 1000);
+    if(s->samples <= AUTO_REGIONS * len)
+        len = (uint32_t)(s->samples / AUTO_REGIONS);
+    wav = malloc((size_t)AUTO_REGIONS * len * s->channels * sizeof(int32_t));
+    if(!wav)
+        return -1;
+    n = 0;
+    for(i=0; i<AUTO_REGIONS; i++) {
+        pos = (s->samples - len) * (2*i+1) / (2*AUTO_REGIONS);
+        if(pcm_seek(ctx, info, pos))
+            break;
+        nr = pcm_read_samples(ctx, &wav[n*s->channels], s, len);
+        if(nr <= 0)
+            break;
+        n += nr;
+    }
+    if(pcm_seek(ctx, info, 0) || n < AUTO_MIN_SAMPLES) {
+        free(wav);
+        return -1;
+    }
+
+    count = 0;
+    for(lvl=0; lvl<=12; lvl++) {
+        if(!auto_encode(s, lvl, wav, n, &res[count]))
+            count++;
+    }
+    free(wav);
+    if(!count)
+        return -1;
+
+    // drop levels which are slower and not smaller than another level
+    best_bytes = res[0].bytes;
+    for(i=0; i<count; i++)
+        best_bytes = MIN(best_bytes, res[i].bytes);
+    best = -1;
+    for(i=0; i<count; i++) {
+        for(lvl=0; lvl<count; lvl++) {
+            if(res[lvl].time < res[i].time && res[lvl].bytes <= res[i].bytes)
+                break;
+        }
+        if(lvl < count)
+            continue;
+        if(!quiet) {
+            fprintf(stderr, "auto: level %2d | bytes: %9"PRIu32" (%+.2f%%) | "
+                            "time: %.1f ms\n", res[i].level, res[i].bytes,
+                    100.0 * ((double)res[i].bytes / best_bytes - 1.0),
+                    1000.0 * res[i].time);
+        }
+        if(res[i].bytes * 1000.0 <= best_bytes * (1000.0 + tol) &&
+           (best < 0 || res[i].time < res[best].time)) {
+            best = i;
+        }
+    }
+    if(!quiet)
+        fprintf(stderr, "auto: chose level %d\n\n", res[best].level);
+    return res[best].level;
+}
+
 static int
 encode_file(CommandOptions *opts, FilePair *files, int first_file)
 {
     FlakeContext s;
     int header_size, subset;
-    uint8_t *frame;
+    uint8_t *out_buffer = NULL;
     int32_t *wav;
-    int percent;
     int fs;
-    uint32_t nr, samplecount, bytecount;
-    float kb, sec, kbps, wav_bytes;
-    int block_align;
+    uint32_t nr;
+    uint64_t samplecount, bytecount, next_progress, progress_step;
+    int i, block_align, s16;
+    ExtraOutput extra[FLAKE_MAX_OUTPUTS];
     PcmContext *ctx=NULL;
 #if HAVE_LIBSNDFILE
     SF_INFO info1;
@@ -514,6 +1095,7 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
     ctx = &ctx1;
 #endif
 
+    memset(&s, 0, sizeof(FlakeContext));
     if (pcm_init(&ctx, info, files->ifp, &s)) {
         fprintf(stderr, "\ninvalid input file: %s\n", files->infile);
         return 1;
@@ -522,9 +1104,21 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
 
     // set parameters from commandline
     s.params.compression = opts->compr;
+    if(opts->autotol >= 0) {
+        int level = choose_auto_level(ctx, info, &s, opts->autotol,
+                                      opts->quiet);
+        if(level >= 0)
+            s.params.compression = level;
+        else if(!opts->quiet)
+            fprintf(stderr, "auto: input is not seekable, using level %d\n\n",
+                    opts->compr);
+    }
     if(flake_set_defaults(&s.params)) {
         return 1;
     }
+    if(opts->lowlat > 0) {
+        flake_set_low_latency(&s.params);
+    }
     if(opts->bsize    >= 0) s.params.block_size           = opts->bsize;
     if(opts->omethod  >= 0) s.params.order_method         = opts->omethod;
     if(opts->stmethod >= 0) s.params.stereo_method        = opts->stmethod;
@@ -548,6 +1142,11 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
     if(opts->pomax    >= 0) s.params.max_partition_order  = opts->pomax;
     if(opts->padding  >= 0) s.params.padding_size         = opts->padding;
     if(opts->vbs      >= 0) s.params.variable_block_size  = opts->vbs;
+    if(opts->fscreen  >= 0) s.params.fixed_screen         = opts->fscreen;
+    if(opts->apod     >= 0) s.params.apodization          = opts->apod;
+    if(opts->tukey    >= 0) s.params.tukey_p              = opts->tukey;
+    if(opts->aprec    >= 0) s.params.float_analysis       = opts->aprec;
+    if(opts->tspeed   >= 0) s.params.target_speed         = opts->tspeed;
 
     subset = flake_validate_params(&s);
     if(subset < 0) {
@@ -562,9 +1161,27 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
         fprintf(stderr, "Error initializing encoder.\n");
         return 1;
     }
+    if(set_file_sink(&s, files->ofp, &out_buffer)) {
+        flake_encode_close(&s);
+        fprintf(stderr, "Error initializing encoder.\n");
+        return 1;
+    }
     if (fwrite(s.header, header_size, 1, files->ofp) != 1) {
         fprintf(stderr, "\nError writing header to output\n");
     }
+    if(opts->extra_count && !strcmp(files->outfile, "-")) {
+        fprintf(stderr, "Error: extra outputs need an output file name.\n");
+        flake_encode_close(&s);
+        return 1;
+    }
+    for(i=0; i<opts->extra_count; i++) {
+        if(open_extra(opts, &s, files, &extra[i], opts->extra[i])) {
+            for(; i>=0; i--)
+                close_extra(&extra[i], 1);
+            flake_encode_close(&s);
+            return 1;
+        }
+    }
 
     // print encoding parameters
     if(first_file && !opts->quiet) {
@@ -599,7 +1216,7 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
             ts = ts % 60;
             th = tm / 60;
             tm = tm % 60;
-            fprintf(stderr, "samples: %"PRIu32" (", s.samples);
+            fprintf(stderr, "samples: %"PRIu64" (", s.samples);
             if(th) fprintf(stderr, "%dh", th);
             fprintf(stderr, "%dm", tm);
             fprintf(stderr, "%d.%03ds)\n", ts, (int)tms);
@@ -609,18 +1226,16 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
         fprintf(stderr, "\n");
     }
 
-    frame = flake_get_buffer(&s);
     wav = malloc(s.params.block_size * s.channels * sizeof(int32_t));
 
-    samplecount = percent = 0;
-    wav_bytes = 0;
+    samplecount = next_progress = 0;
+    progress_step = s.sample_rate;
+    if(s.samples > 0)
+        progress_step = MAX(s.samples / 100, 1);
     bytecount = header_size;
-#if HAVE_LIBSNDFILE
-    nr = sndfile_read_samples(ctx, wav, s.bits_per_sample, s.channels,
-                              s.params.block_size);
-#else
-    nr = pcmfile_read_samples(ctx, wav, s.params.block_size);
-#endif
+    s16 = pcm_use_s16(ctx, &s);
+    pcm_read_ahead(ctx, &s);
+    nr = encode_next_frame(ctx, &s, wav, s16, &fs);
     while(nr > 0) {
         /*unsigned int z,ch;
         for (z = 0; z < nr; z++) {
@@ -629,53 +1244,39 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
                 fprintf(stderr, "%-5d", wav[z*s.channels+ch]);
             }
         }*/
-        fs = flake_encode_frame(&s, wav, nr);
         if(fs < 0) {
             fprintf(stderr, "\nError encoding frame\n");
         } else if(fs > 0) {
-            if(fwrite(frame, fs, 1, files->ofp) != 1) {
-                fprintf(stderr, "\nError writing frame to output\n");
-            }
-            samplecount = MAX(samplecount, samplecount+nr);
+            samplecount += nr;
             if(!opts->quiet) {
                 bytecount += fs;
-                kb = ((bytecount * 8.0) / 1000.0);
-                sec = ((float)samplecount) / ((float)s.sample_rate);
-                if(samplecount > 0) kbps = kb / sec;
-                else kbps = kb;
-                if(s.samples > 0) {
-                    percent = ((samplecount * 100.5) / s.samples);
-                }
-                wav_bytes = samplecount * block_align;
-                if(!opts->quiet) {
-                    fprintf(stderr, "\rprogress: %3d%% | ratio: %1.3f | "
-                                    "bitrate: %4.1f kbps ",
-                            percent, (bytecount / wav_bytes), kbps);
+                // update the progress line once per percent, or once per
+                // second of audio if the length is unknown
+                if(samplecount >= next_progress) {
+                    print_progress(&s, samplecount, bytecount, block_align);
+                    next_progress = samplecount + progress_step;
                 }
             }
         }
-#if HAVE_LIBSNDFILE
-        nr = sndfile_read_samples(ctx, wav, s.bits_per_sample, s.channels,
-                                  s.params.block_size);
-#else
-        nr = pcmfile_read_samples(ctx, wav, s.params.block_size);
-#endif
+        nr = encode_next_frame(ctx, &s, wav, s16, &fs);
     }
     if(!opts->quiet) {
-        fprintf(stderr, "| bytes: %d \n\n", bytecount);
+        print_progress(&s, samplecount, bytecount, block_align);
+        fprintf(stderr, "| bytes: %"PRIu64" \n\n", bytecount);
+        if(s.params.target_speed > 0)
+            print_speed_stats(&s);
+        if(s.params.low_latency)
+            print_latency_stats(&s);
     }
 
-    // if seeking is possible, rewrite streaminfo metadata header
-    if(!fseek(files->ofp, 8, SEEK_SET)) {
-        FlakeStreaminfo strminfo;
-        if(!flake_get_streaminfo(&s, &strminfo)) {
-            uint8_t strminfo_data[34];
-            flake_write_streaminfo(&strminfo, strminfo_data);
-            if (fwrite(strminfo_data, 34, 1, files->ofp) != 1) {
-                fprintf(stderr, "\nError writing header to output\n");
-            }
-        }
+    if(flake_flush_outputs(&s) < 0) {
+        fprintf(stderr, "\nError encoding frame\n");
     }
+    finish_output(&s);
+    for(i=0; i<opts->extra_count; i++)
+        close_extra(&extra[i], opts->quiet);
+    if(opts->extra_count && !opts->quiet)
+        fprintf(stderr, "\n");
 
 #if HAVE_LIBSNDFILE
     sf_close(ctx);
@@ -683,6 +1284,7 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
     pcmfile_close(ctx);
 #endif
     flake_encode_close(&s);
+    free(out_buffer);
     free(wav);
 
     return 0;
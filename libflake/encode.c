@@ -27,6 +27,7 @@
 #include "md5.h"
 #include "optimize.h"
 #include "rice.h"
+#include "speed.h"
 #include "vbs.h"
 
 
@@ -180,6 +181,12 @@ flake_set_defaults(FlakeEncodeParams *params)
     params->padding_size = 8192;
     params->variable_block_size = 0;
     params->allow_vbs = 0;
+    params->fixed_screen = 0;
+    params->apodization = FLAKE_WINDOW_WELCH;
+    params->tukey_p = 50;
+    params->float_analysis = 0;
+    params->target_speed = 0;
+    params->low_latency = 0;
 
     // differences from level 5
     switch(lvl) {
@@ -253,6 +260,7 @@ flake_set_defaults(FlakeEncodeParams *params)
             params->variable_block_size = 1;
             break;
         case 12:
+            params->stereo_method = FLAKE_STEREO_METHOD_EXACT;
             params->block_size = 8192;
             params->order_method = FLAKE_ORDER_METHOD_SEARCH;
             params->max_prediction_order = 32;
@@ -265,6 +273,30 @@ flake_set_defaults(FlakeEncodeParams *params)
     return 0;
 }
 
+int
+flake_set_low_latency(FlakeEncodeParams *params)
+{
+    if(!params) {
+        return -1;
+    }
+
+    params->low_latency = 1;
+    params->block_size = 256;
+    if(params->order_method != FLAKE_ORDER_METHOD_MAX)
+        params->order_method = FLAKE_ORDER_METHOD_EST;
+    params->max_prediction_order = MIN(params->max_prediction_order, 12);
+    params->min_prediction_order = MIN(params->min_prediction_order,
+                                       params->max_prediction_order);
+    params->stereo_method = MIN(params->stereo_method,
+                                FLAKE_STEREO_METHOD_ESTIMATE);
+    params->variable_block_size = 0;
+    params->allow_vbs = 0;
+    params->apodization = FLAKE_WINDOW_WELCH;
+    params->target_speed = 0;
+
+    return 0;
+}
+
 int
 flake_validate_params(const FlakeContext *s)
 {
@@ -297,14 +329,51 @@ flake_validate_params(const FlakeContext *s)
         return -1;
     }
 
-    if(params->order_method < 0 || params->order_method > 6) {
+    if(params->order_method < 0 || params->order_method > 7) {
+        return -1;
+    }
+
+    if(params->stereo_method < 0 || params->stereo_method > 2) {
+        return -1;
+    }
+
+    if(params->fixed_screen < 0 || params->fixed_screen > 100) {
+        return -1;
+    }
+
+    if(params->target_speed < 0) {
+        return -1;
+    }
+
+    if(params->apodization < 0 || params->apodization > 15) {
         return -1;
     }
 
-    if(params->stereo_method < 0 || params->stereo_method > 1) {
+    if(params->tukey_p < 0 || params->tukey_p > 100) {
         return -1;
     }
 
+    if(params->float_analysis < 0 || params->float_analysis > 1) {
+        return -1;
+    }
+
+    // the low-latency profile needs a bounded amount of work per frame and
+    // no audio held back between frames
+    if(params->low_latency < 0 || params->low_latency > 1) {
+        return -1;
+    }
+    if(params->low_latency) {
+        if(params->order_method > FLAKE_ORDER_METHOD_EST ||
+           params->stereo_method > FLAKE_STEREO_METHOD_ESTIMATE ||
+           params->allow_vbs || params->target_speed > 0) {
+            return -1;
+        }
+        if(params->apodization & (params->apodization - 1) ||
+           params->apodization == FLAKE_WINDOW_PARTIAL_TUKEY) {
+            return -1;
+        }
+    }
+
     bs = params->block_size;
     if(bs < FLAC_MIN_BLOCKSIZE || bs > FLAC_MAX_BLOCKSIZE) {
         return -1;
@@ -357,7 +426,7 @@ flake_validate_params(const FlakeContext *s)
         return -1;
     }
 
-    if(params->variable_block_size < 0 || params->variable_block_size > 1) {
+    if(params->variable_block_size < 0 || params->variable_block_size > 2) {
         return -1;
     }
     if(params->variable_block_size > 0 && !params->allow_vbs) {
@@ -373,26 +442,69 @@ flake_validate_params(const FlakeContext *s)
 }
 
 /**
- * Initialize encoder
+ * Histogram bin of a latency in seconds.  Bin i holds latencies below
+ * 2^((i+1)/4) microseconds.
  */
-int
-flake_encode_init(FlakeContext *s)
+static int
+latency_bin(double t)
 {
-    FlacEncodeContext *ctx;
-    int i, header_len;
+    int bin;
 
-    if(s == NULL) {
-        return -1;
-    }
+    if(t <= 1e-6)
+        return 0;
+    bin = (int)(4.0 * log2(t * 1e6));
+    return CLIP(bin, 0, FLAKE_LATENCY_BINS-1);
+}
 
-    // allocate memory
-    ctx = calloc(1, sizeof(FlacEncodeContext));
-    s->private_ctx = ctx;
-    ctx->parent = s;
+/**
+ * Pass the frames collected in the sink buffer to the sink
+ */
+static int
+flush_sink(FlacEncodeContext *ctx)
+{
+    int i, n;
+    double now;
 
-    if(flake_validate_params(s) < 0) {
+    now = speed_get_wall_time();
+    for(i=0; i<ctx->sink_frames; i++)
+        ctx->stats.latency[latency_bin(now - ctx->sink_time[i])]++;
+    ctx->sink_frames = 0;
+
+    n = ctx->sink_fill;
+    ctx->sink_fill = 0;
+    if(n > 0 && ctx->write_frame(ctx->write_opaque, ctx->sink_buffer, n) < 0)
         return -1;
+    return 0;
+}
+
+/**
+ * Give the outputs of an encoder the final checksum of the input and make
+ * them independent encoders again
+ */
+static void
+detach_outputs(FlacEncodeContext *ctx)
+{
+    int i;
+    FlacEncodeContext *out;
+    MD5Context md5_bak;
+
+    for(i=0; i<ctx->output_count; i++) {
+        out = ctx->outputs[i];
+        md5_bak = ctx->md5ctx;
+        md5_final(out->md5sum, &md5_bak);
+        out->have_md5sum = 1;
+        out->driver = NULL;
     }
+    ctx->output_count = 0;
+}
+
+/**
+ * Set the stream properties from the user context
+ */
+static void
+init_stream(FlacEncodeContext *ctx, FlakeContext *s)
+{
+    int i;
 
     ctx->channels = s->channels;
     ctx->ch_code = s->channels-1;
@@ -433,15 +545,48 @@ flake_encode_init(FlakeContext *s)
         ctx->bps_code = 0;
     }
 
-
     ctx->sample_count = s->samples;
 
     ctx->params = s->params;
+}
+
+/**
+ * Initialize encoder
+ */
+int
+flake_encode_init(FlakeContext *s)
+{
+    FlacEncodeContext *ctx;
+    MemContext mem;
+    int header_len;
+
+    if(s == NULL) {
+        return -1;
+    }
+
+    // allocate memory
+    mem_init(&mem, s->allocator);
+    ctx = mem_calloc(&mem, 1, sizeof(FlacEncodeContext));
+    s->private_ctx = ctx;
+    s->header = NULL;
+    if(!ctx)
+        return -1;
+    ctx->mem = mem;
+    ctx->parent = s;
+
+    if(flake_validate_params(s) < 0) {
+        return -1;
+    }
+
+    init_stream(ctx, s);
 
     // right now 15-bit precision seems to generally work better than adaptive.
     // TODO: try adapting based on prediction order, not blocksize
     ctx->lpc_precision = 15;
 
+    lpc_init(&ctx->lpc, &ctx->mem, ctx->params.apodization,
+             ctx->params.tukey_p, ctx->params.float_analysis);
+
     // set maximum encoded frame size (if larger, re-encodes in verbatim mode)
     if(ctx->channels == 2) {
         ctx->max_frame_size = 16 + ((ctx->params.block_size * (ctx->bps+ctx->bps+1) + 7) >> 3);
@@ -451,11 +596,16 @@ flake_encode_init(FlakeContext *s)
 
     // initialize frame buffer
     ctx->frame_buffer_size = ctx->max_frame_size * 3 / 2;
-    ctx->frame_buffer = calloc(ctx->frame_buffer_size, 1);
+    ctx->frame_buffer = mem_calloc(&ctx->mem, ctx->frame_buffer_size, 1);
+    ctx->frame_out = ctx->frame_buffer;
+    if(ctx->params.variable_block_size == 2) {
+        ctx->vbs_buffer_size = ctx->frame_buffer_size * VBS_SEARCH_LEVELS;
+        ctx->vbs_buffer = mem_calloc(&ctx->mem, ctx->vbs_buffer_size, 1);
+    }
 
     // output header bytes
-    ctx->bw = calloc(sizeof(BitWriter), 1);
-    s->header = calloc(ctx->params.padding_size + 1024, 1);
+    ctx->bw = mem_calloc(&ctx->mem, sizeof(BitWriter), 1);
+    s->header = mem_calloc(&ctx->mem, ctx->params.padding_size + 1024, 1);
     header_len = -1;
     if(s->header != NULL) {
         header_len = write_headers(ctx, s->header);
@@ -464,13 +614,88 @@ flake_encode_init(FlakeContext *s)
     ctx->frame_count = 0;
     ctx->last_frame = 0;
 
+    if(ctx->params.target_speed > 0) {
+        speed_init(ctx);
+    }
+
     // initialize CRC & MD5
     crc_init();
-    md5_init(&ctx->md5ctx);
+    md5_init(&ctx->md5ctx, &ctx->mem);
 
     return header_len;
 }
 
+int
+flake_encode_reset(FlakeContext *s)
+{
+    FlacEncodeContext *ctx;
+    LpcContext lpc;
+    int header_size;
+
+    if(!s || !s->private_ctx)
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(ctx->driver)
+        return -1;
+    if(flake_validate_params(s) < 0)
+        return -1;
+
+    // the frame buffers are sized for the channels, bit depth and block size
+    if(s->channels != ctx->channels || s->bits_per_sample != ctx->bps ||
+       s->params.block_size != ctx->params.block_size)
+        return -1;
+
+    // frames still in the sink buffer belong to the previous stream
+    if(ctx->sink_buffer && flush_sink(ctx))
+        return -1;
+    detach_outputs(ctx);
+
+    if(s->params.variable_block_size == 2 && !ctx->vbs_buffer) {
+        ctx->vbs_buffer_size = ctx->frame_buffer_size * VBS_SEARCH_LEVELS;
+        ctx->vbs_buffer = mem_calloc(&ctx->mem, ctx->vbs_buffer_size, 1);
+        if(!ctx->vbs_buffer)
+            return -1;
+    }
+    header_size = ctx->params.padding_size + 1024;
+    if(s->params.padding_size > ctx->params.padding_size || !s->header) {
+        mem_free(&ctx->mem, s->header);
+        header_size = s->params.padding_size + 1024;
+        s->header = mem_alloc(&ctx->mem, header_size);
+        if(!s->header)
+            return -1;
+    }
+
+    init_stream(ctx, s);
+
+    // the cached windows are kept unless the apodization changes
+    lpc_init(&lpc, &ctx->mem, ctx->params.apodization, ctx->params.tukey_p,
+             ctx->params.float_analysis);
+    if(!lpc_same_windows(&lpc, &ctx->lpc)) {
+        lpc_close(&ctx->lpc);
+        ctx->lpc = lpc;
+    }
+
+    // the padding is left as zeros
+    memset(s->header, 0, header_size);
+    header_size = write_headers(ctx, s->header);
+
+    ctx->frame_count = 0;
+    ctx->last_frame = 0;
+    ctx->hint = NULL;
+    ctx->fifo_len = 0;
+    ctx->have_md5sum = 0;
+    memset(&ctx->last, 0, sizeof(LpcHistory));
+    memset(&ctx->stats, 0, sizeof(FlakeEncodeStats));
+
+    if(ctx->params.target_speed > 0) {
+        speed_init(ctx);
+    }
+
+    md5_reset(&ctx->md5ctx);
+
+    return header_size;
+}
+
 void *
 flake_get_buffer(const FlakeContext *s)
 {
@@ -484,6 +709,17 @@ flake_get_buffer(const FlakeContext *s)
     return ctx->frame_buffer;
 }
 
+int
+flake_get_buffer_size(const FlakeContext *s)
+{
+    FlacEncodeContext *ctx;
+
+    if(!s || !s->private_ctx)
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    return ctx->frame_buffer_size;
+}
+
 /**
  * Initialize the current frame before encoding
  */
@@ -539,50 +775,218 @@ init_frame(FlacEncodeContext *ctx, int block_size)
  * Copy channel-interleaved input samples into separate subframes
  */
 static void
-copy_samples(FlacEncodeContext *ctx, const int32_t *samples)
+copy_samples(FlacEncodeContext *ctx, const int32_t *samples, int n)
+{
+    int i, j, ch;
+    FlacFrame *frame;
+
+    frame = &ctx->frame;
+    for(i=0,j=0; i<n; i++) {
+        for(ch=0; ch<ctx->channels; ch++,j++) {
+            frame->subframes[ch].samples[i] = samples[j];
+        }
+    }
+}
+
+/**
+ * Copy separate channel buffers, from sample offset on, into the subframes
+ */
+static void
+copy_samples_planar(FlacEncodeContext *ctx, const int32_t *const *samples,
+                    int offset, int n)
+{
+    int ch;
+    FlacFrame *frame;
+
+    frame = &ctx->frame;
+    for(ch=0; ch<ctx->channels; ch++) {
+        memcpy(frame->subframes[ch].samples, samples[ch] + offset,
+               n * sizeof(int32_t));
+    }
+}
+
+/**
+ * Copy channel-interleaved 16-bit samples into separate subframes
+ */
+static void
+copy_samples_s16(FlacEncodeContext *ctx, const int16_t *samples, int n)
 {
     int i, j, ch;
     FlacFrame *frame;
 
     frame = &ctx->frame;
-    for(i=0,j=0; i<frame->blocksize; i++) {
+    for(i=0,j=0; i<n; i++) {
         for(ch=0; ch<ctx->channels; ch++,j++) {
             frame->subframes[ch].samples[i] = samples[j];
         }
     }
 }
 
+/**
+ * Copy channel-interleaved packed 24-bit samples into separate subframes
+ */
+static void
+copy_samples_s24(FlacEncodeContext *ctx, const uint8_t *samples, int n)
+{
+    int i, ch;
+    FlacFrame *frame;
+
+    frame = &ctx->frame;
+    for(i=0; i<n; i++) {
+        for(ch=0; ch<ctx->channels; ch++,samples+=3) {
+            frame->subframes[ch].samples[i] =
+                (int32_t)(((uint32_t)samples[2] << 24) |
+                          ((uint32_t)samples[1] << 16) |
+                          ((uint32_t)samples[0] << 8)) >> 8;
+        }
+    }
+}
+
+void
+copy_input(FlacEncodeContext *ctx, const InputBlock *in, int block_size)
+{
+    int k = in->offset * ctx->channels;
+
+    switch(in->format) {
+        case INPUT_S32:
+            copy_samples(ctx, (const int32_t *)in->data + k, block_size);
+            break;
+        case INPUT_PLANAR:
+            copy_samples_planar(ctx, in->data, in->offset, block_size);
+            break;
+        case INPUT_S16:
+            copy_samples_s16(ctx, (const int16_t *)in->data + k, block_size);
+            break;
+        case INPUT_S24:
+            copy_samples_s24(ctx, (const uint8_t *)in->data + 3*k, block_size);
+            break;
+    }
+}
+
+/**
+ * Add the input to the MD5 checksum.  Packed input is already in the byte
+ * layout which is hashed.
+ */
+static void
+md5_input(FlacEncodeContext *ctx, const InputBlock *in, int block_size)
+{
+    int ch;
+    int k = in->offset * ctx->channels;
+    int n = block_size * ctx->channels;
+    const int32_t *signal[FLAC_MAX_CH];
+
+    switch(in->format) {
+        case INPUT_S32:
+            md5_accumulate(&ctx->md5ctx, (const int32_t *)in->data + k,
+                           ctx->channels, ctx->bps, block_size);
+            break;
+        case INPUT_PLANAR:
+            for(ch=0; ch<ctx->channels; ch++)
+                signal[ch] = ((const int32_t *const *)in->data)[ch] + in->offset;
+            md5_accumulate_planar(&ctx->md5ctx, signal, ctx->channels,
+                                  ctx->bps, block_size);
+            break;
+        case INPUT_S16:
+            md5_accumulate_s16(&ctx->md5ctx, (const int16_t *)in->data + k, n);
+            break;
+        case INPUT_S24:
+            md5_update(&ctx->md5ctx, (const uint8_t *)in->data + 3*k, n * 3);
+            break;
+    }
+}
+
+/**
+ * Write n samples of input, from start samples into the block, to a buffer
+ * of interleaved int32 samples
+ */
+static void
+interleave_input(int channels, const InputBlock *in, int start, int n,
+                 int32_t *dst)
+{
+    int i, ch;
+    int k = (in->offset + start) * channels;
+
+    switch(in->format) {
+        case INPUT_S32:
+            memcpy(dst, (const int32_t *)in->data + k,
+                   n * channels * sizeof(int32_t));
+            break;
+        case INPUT_PLANAR:
+            for(i=0; i<n; i++) {
+                for(ch=0; ch<channels; ch++) {
+                    *dst++ = ((const int32_t *const *)in->data)[ch][in->offset +
+                                                                   start + i];
+                }
+            }
+            break;
+        case INPUT_S16:
+            for(i=0; i<n*channels; i++)
+                dst[i] = ((const int16_t *)in->data)[k+i];
+            break;
+        case INPUT_S24: {
+            const uint8_t *p = (const uint8_t *)in->data + 3*k;
+            for(i=0; i<n*channels; i++, p+=3) {
+                dst[i] = (int32_t)(((uint32_t)p[2] << 24) |
+                                   ((uint32_t)p[1] << 16) |
+                                   ((uint32_t)p[0] << 8)) >> 8;
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * Count the zero bits common to the low end of all samples.
+ */
+static int
+count_wasted_bits(const int32_t *samples, int n, int bps)
+{
+    int i, b;
+    int wasted;
+
+    wasted = bps-1;
+    for (i = 0; i < n; i++) {
+        uint32_t s = samples[i];
+        if (s) {
+            s = (s ^ (s - 1)) >> 1;
+            for (b = 0; s; b++) {
+                s >>= 1;
+            }
+            if (b < wasted)
+                wasted = b;
+            if (!wasted)
+                break;
+        }
+    }
+    if (wasted == bps-1)
+        wasted = 0;
+    return wasted;
+}
+
 /**
  * Shift out any zero bits and set the wasted_bits parameter.
+ * This is done for the first nch subframes.
  */
 static void
-remove_wasted_bits(FlacEncodeContext *ctx)
+remove_wasted_bits(FlacEncodeContext *ctx, int nch)
 {
-    int i, ch, b;
+    int i, ch, src;
     int wasted;
     FlacFrame *frame;
     int32_t *samples;
 
     frame = &ctx->frame;
-    for (ch = 0; ch < ctx->channels; ch++) {
-        wasted = ctx->bps-1;
+    for (ch = 0; ch < nch; ch++) {
         samples = frame->subframes[ch].samples;
-        for (i = 0; i < frame->blocksize; i++) {
-            uint32_t s = samples[i];
-            if (s) {
-                s = (s ^ (s - 1)) >> 1;
-                for (b = 0; s; b++) {
-                    s >>= 1;
-                }
-                if (b < wasted)
-                    wasted = b;
-                if (!wasted)
-                    break;
-            }
+        src = channel_source(frame->ch_mode, ch);
+        if (ctx->shared && ctx->shared->wasted[src] >= 0) {
+            wasted = ctx->shared->wasted[src];
+        } else {
+            wasted = count_wasted_bits(samples, frame->blocksize, ctx->bps);
+            if (ctx->shared)
+                ctx->shared->wasted[src] = wasted;
         }
-        if (wasted == ctx->bps-1) {
-            wasted = 0;
-        } else if (wasted) {
+        if (wasted) {
             for (i = 0; i < frame->blocksize; i++) {
                 samples[i] >>= wasted;
             }
@@ -592,32 +996,44 @@ remove_wasted_bits(FlacEncodeContext *ctx)
     }
 }
 
+void
+calc_decorr_sums(const int32_t *left_ch, const int32_t *right_ch, int stride,
+                 int start, int end, uint64_t sum[4])
+{
+    int i;
+    int32_t lt, rt;
+    const int32_t *l, *r;
+
+    sum[0] = sum[1] = sum[2] = sum[3] = 0;
+    l = &left_ch[start*stride];
+    r = &right_ch[start*stride];
+    for(i=start; i<end; i++) {
+        lt = l[0] - 2*l[-stride] + l[-2*stride];
+        rt = r[0] - 2*r[-stride] + r[-2*stride];
+        sum[2] += abs((lt + rt) >> 1);
+        sum[3] += abs(lt - rt);
+        sum[0] += abs(lt);
+        sum[1] += abs(rt);
+        l += stride;
+        r += stride;
+    }
+}
+
 /**
  * Estimate the best stereo decorrelation mode
  */
 static int
-calc_decorr_scores(int32_t *left_ch, int32_t *right_ch, int n)
+calc_decorr_scores(const uint64_t *sums, int n)
 {
     int i, best;
-    int32_t lt, rt;
     uint64_t sum[4];
     uint64_t score[4];
     int k;
 
-    // calculate sum of 2nd order residual for each channel
-    sum[0] = sum[1] = sum[2] = sum[3] = 0;
-    for(i=2; i<n; i++) {
-        lt = left_ch[i] - 2*left_ch[i-1] + left_ch[i-2];
-        rt = right_ch[i] - 2*right_ch[i-1] + right_ch[i-2];
-        sum[2] += abs((lt + rt) >> 1);
-        sum[3] += abs(lt - rt);
-        sum[0] += abs(lt);
-        sum[1] += abs(rt);
-    }
     // estimate bit counts
     for(i=0; i<4; i++) {
-        k = find_optimal_rice_param(2*sum[i], n);
-        sum[i] = rice_encode_count(2*sum[i], n, k);
+        k = find_optimal_rice_param(2*sums[i], n);
+        sum[i] = rice_encode_count(2*sums[i], n, k);
     }
 
     // calculate score for each mode
@@ -667,7 +1083,22 @@ channel_decorrelation(FlacEncodeContext *ctx)
     }
 
     // estimate stereo decorrelation type
-    frame->ch_mode = calc_decorr_scores(left, right, frame->blocksize);
+    if(ctx->hint) {
+        frame->ch_mode = calc_decorr_scores(ctx->hint->decorr_sums,
+                                            frame->blocksize);
+    } else if(ctx->shared) {
+        if(!ctx->shared->have_sums) {
+            calc_decorr_sums(left, right, 1, 2, frame->blocksize,
+                             ctx->shared->decorr_sums);
+            ctx->shared->have_sums = 1;
+        }
+        frame->ch_mode = calc_decorr_scores(ctx->shared->decorr_sums,
+                                            frame->blocksize);
+    } else {
+        uint64_t sums[4];
+        calc_decorr_sums(left, right, 1, 2, frame->blocksize, sums);
+        frame->ch_mode = calc_decorr_scores(sums, frame->blocksize);
+    }
 
     // perform decorrelation and adjust bits-per-sample
     if(frame->ch_mode == FLAC_CHMODE_LEFT_RIGHT) {
@@ -694,24 +1125,112 @@ channel_decorrelation(FlacEncodeContext *ctx)
 }
 
 /**
- * Write UTF-8 encoded integer value
- * Used to encode frame number in frame header
+ * Copy an encoded subframe to another channel.  The LPC history is kept by
+ * signal, so it is not moved.
  */
 static void
-write_utf8(BitWriter *bw, uint32_t val)
+move_subframe(FlacEncodeContext *ctx, int dst, int src)
 {
-    int bytes, shift;
+    int n;
+    FlacSubframe *d, *s;
+
+    n = ctx->frame.blocksize;
+    d = &ctx->frame.subframes[dst];
+    s = &ctx->frame.subframes[src];
+    d->type = s->type;
+    d->type_code = s->type_code;
+    d->wasted_bits = s->wasted_bits;
+    d->order = s->order;
+    d->obits = s->obits;
+    memcpy(d->coefs, s->coefs, sizeof(s->coefs));
+    d->shift = s->shift;
+    memcpy(d->samples, s->samples, n * sizeof(int32_t));
+    memcpy(d->residual, s->residual, n * sizeof(int32_t));
+    d->rc = s->rc;
+}
 
-    if(val < 0x80){
-        bitwriter_writebits(bw, 8, val);
-        return;
+/**
+ * Choose the stereo decorrelation mode by encoding all of left, right, mid
+ * and side.  They are analyzed in subframes 0 to 3, and the chosen pair is
+ * then moved to subframes 0 and 1.
+ */
+static int
+encode_stereo_exact(FlacEncodeContext *ctx)
+{
+    int i, ch, best;
+    int bits[4];
+    int64_t score[4];
+    FlacFrame *frame;
+    int32_t *left, *right, *mid, *side;
+
+    frame = &ctx->frame;
+    left  = frame->subframes[0].samples;
+    right = frame->subframes[1].samples;
+    mid   = frame->subframes[2].samples;
+    side  = frame->subframes[3].samples;
+    for(i=0; i<frame->blocksize; i++) {
+        mid[i] = (left[i] + right[i]) >> 1;
+        side[i] = left[i] - right[i];
+    }
+    frame->subframes[2].obits = ctx->bps;
+    frame->subframes[3].obits = ctx->bps + 1;
+
+    // with independent channels, subframe k codes signal k
+    frame->ch_mode = FLAC_CHMODE_LEFT_RIGHT;
+    remove_wasted_bits(ctx, 4);
+    for(ch=0; ch<4; ch++) {
+        bits[ch] = encode_residual(ctx, ch);
+        if(bits[ch] < 0) {
+            return -1;
+        }
+    }
+
+    score[0] = (int64_t)bits[0] + bits[1];
+    score[1] = (int64_t)bits[0] + bits[3];
+    score[2] = (int64_t)bits[1] + bits[3];
+    score[3] = (int64_t)bits[2] + bits[3];
+    best = 0;
+    for(i=1; i<4; i++) {
+        if(score[i] < score[best]) {
+            best = i;
+        }
+    }
+
+    switch(best) {
+        case 1: frame->ch_mode = FLAC_CHMODE_LEFT_SIDE;
+                move_subframe(ctx, 1, 3);
+                break;
+        case 2: frame->ch_mode = FLAC_CHMODE_RIGHT_SIDE;
+                move_subframe(ctx, 0, 3);
+                break;
+        case 3: frame->ch_mode = FLAC_CHMODE_MID_SIDE;
+                move_subframe(ctx, 0, 2);
+                move_subframe(ctx, 1, 3);
+                break;
+    }
+    return 0;
+}
+
+/**
+ * Write UTF-8 encoded integer value
+ * Used to encode frame or sample number in frame header.  Sample numbers
+ * take up to 36 bits, in 7 bytes.
+ */
+static void
+write_utf8(BitWriter *bw, uint64_t val)
+{
+    int bytes, shift;
+
+    if(val < 0x80){
+        bitwriter_writebits(bw, 8, (uint32_t)val);
+        return;
     }
-    bytes = (log2i(val)+4) / 5;
+    bytes = (val >> 31) ? 7 : (log2i((uint32_t)val)+4) / 5;
     shift = (bytes - 1) * 6;
-    bitwriter_writebits(bw, 8, (256 - (256>>bytes)) | (val >> shift));
+    bitwriter_writebits(bw, 8, (256 - (256>>bytes)) | (uint32_t)(val >> shift));
     while(shift >= 6){
         shift -= 6;
-        bitwriter_writebits(bw, 8, 0x80 | ((val >> shift) & 0x3F));
+        bitwriter_writebits(bw, 8, 0x80 | (uint32_t)((val >> shift) & 0x3F));
     }
 }
 
@@ -918,27 +1437,37 @@ output_frame_footer(FlacEncodeContext *ctx)
 
 int
 encode_frame(FlacEncodeContext *ctx, uint8_t *frame_buffer, int buf_size,
-             const int32_t *samples, int block_size)
+             const InputBlock *in, int block_size)
 {
     int i, ch;
+    FlacFrame *frame;
 
-    if(!ctx || !samples || buf_size <= 0)
+    if(!ctx || !in || buf_size <= 0)
         return -1;
 
     if(init_frame(ctx, block_size)) {
         return -1;
     }
 
-    copy_samples(ctx, samples);
-
-    channel_decorrelation(ctx);
+    copy_input(ctx, in, block_size);
 
-    remove_wasted_bits(ctx);
+    frame = &ctx->frame;
 
-    for(ch=0; ch<ctx->channels; ch++) {
-        if(encode_residual(ctx, ch) < 0) {
+    if(ctx->channels == 2 && frame->blocksize > 32 &&
+       ctx->params.stereo_method == FLAKE_STEREO_METHOD_EXACT) {
+        if(encode_stereo_exact(ctx) < 0) {
             return -1;
         }
+    } else {
+        channel_decorrelation(ctx);
+
+        remove_wasted_bits(ctx, ctx->channels);
+
+        for(ch=0; ch<ctx->channels; ch++) {
+            if(encode_residual(ctx, ch) < 0) {
+                return -1;
+            }
+        }
     }
 
     bitwriter_init(ctx->bw, frame_buffer, buf_size);
@@ -976,52 +1505,544 @@ encode_frame(FlacEncodeContext *ctx, uint8_t *frame_buffer, int buf_size,
     return bitwriter_count(ctx->bw);
 }
 
+/**
+ * Encode one block of input and account for it.  If shared is set, the
+ * frame analysis is shared with the other outputs of the encoder.
+ * t_in is the wall time the first sample of the block was passed in, from
+ * which the latency of the frame is measured.
+ */
+static int
+encode_block(FlacEncodeContext *ctx, const InputBlock *in, int block_size,
+             SharedFrame *shared, double t_in)
+{
+    int fs, level;
+    double t0;
+
+    t0 = speed_get_time();
+    level = ctx->params.compression;
+    if(ctx->params.target_speed > 0) {
+        speed_select_level(ctx);
+        level = ctx->speed.level;
+    }
+
+    // frames are encoded in place in the sink buffer, which is passed on
+    // when another frame of the largest size might not fit
+    ctx->frame_out = ctx->frame_buffer;
+    if(ctx->sink_buffer) {
+        if((ctx->sink_size - ctx->sink_fill < ctx->frame_buffer_size ||
+            ctx->sink_frames == SINK_MAX_FRAMES) && flush_sink(ctx))
+            return -1;
+        ctx->frame_out = ctx->sink_buffer + ctx->sink_fill;
+    }
+
+    fs = -1;
+    if((ctx->params.variable_block_size > 0) &&
+       !(block_size % VBS_MAX_FRAMES) && block_size >= VBS_MIN_BLOCK_SIZE) {
+        fs = encode_frame_vbs(ctx, in, block_size);
+    }
+    if(fs < 0) {
+        ctx->shared = shared;
+        fs = encode_frame(ctx, ctx->frame_out, ctx->frame_buffer_size,
+                          in, block_size);
+        ctx->shared = NULL;
+    }
+    // the outputs of an encoder share its checksum
+    if(fs > 0 && !ctx->driver)
+        md5_input(ctx, in, block_size);
+    if(fs > 0) {
+        t0 = speed_get_time() - t0;
+        ctx->stats.frames++;
+        ctx->stats.samples += block_size;
+        ctx->stats.bytes += fs;
+        ctx->stats.encode_time += t0;
+        ctx->stats.level_frames[level]++;
+        if(ctx->params.target_speed > 0) {
+            speed_update(ctx, block_size, t0);
+        }
+        // the latency runs until the frame is passed to the caller
+        if(ctx->sink_buffer) {
+            ctx->sink_fill += fs;
+            ctx->sink_time[ctx->sink_frames++] = t_in;
+            if(ctx->params.low_latency && flush_sink(ctx))
+                return -1;
+        } else {
+            ctx->stats.latency[latency_bin(speed_get_wall_time() - t_in)]++;
+            if(ctx->write_frame &&
+               ctx->write_frame(ctx->write_opaque, ctx->frame_out, fs) < 0)
+                return -1;
+        }
+    }
+    return fs;
+}
+
+/**
+ * Pass a block of input to an output.  It is buffered until a frame of the
+ * output's block size is complete, except that a block which is a whole
+ * frame is encoded directly with the shared analysis.
+ */
+static int
+feed_output(FlacEncodeContext *out, const InputBlock *in, int block_size,
+            SharedFrame *shared, double t_in)
+{
+    int n, bs, ch, pos;
+    InputBlock fifo;
+
+    bs = out->params.block_size;
+    ch = out->channels;
+    if(out->last_frame)
+        return -1;
+    if(!out->fifo_len && block_size == bs)
+        return (encode_block(out, in, bs, shared, t_in) < 0) ? -1 : 0;
+
+    fifo.format = INPUT_S32;
+    fifo.data = out->fifo;
+    fifo.offset = 0;
+    for(pos=0; pos<block_size; pos+=n) {
+        if(!out->fifo_len)
+            out->fifo_time = t_in;
+        n = MIN(block_size - pos, bs - out->fifo_len);
+        interleave_input(ch, in, pos, n, &out->fifo[out->fifo_len*ch]);
+        out->fifo_len += n;
+        if(out->fifo_len == bs) {
+            out->fifo_len = 0;
+            if(encode_block(out, &fifo, bs, NULL, out->fifo_time) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check that a block of input can be encoded, and note whether it ends the
+ * stream
+ */
+static int
+start_block(FlacEncodeContext *ctx, int block_size)
+{
+    if(ctx->driver || ctx->fifo_len)
+        return -1;
+    if(block_size < 1 || block_size > ctx->params.block_size)
+        return -1;
+    if(ctx->last_frame)
+        return -1;
+    if(!ctx->params.allow_vbs && block_size != ctx->params.block_size)
+        ctx->last_frame = 1;
+    return 0;
+}
+
+/**
+ * Encode a block of input which was passed in at wall time t_in, and pass it
+ * to the outputs
+ */
+static int
+encode_frame_at(FlakeContext *s, const InputBlock *in, int block_size,
+                double t_in)
+{
+    int i, fs;
+    FlacEncodeContext *ctx;
+    SharedFrame *sf;
+
+    ctx = (FlacEncodeContext *) s->private_ctx;
+
+    if(start_block(ctx, block_size))
+        return -1;
+
+    sf = ctx->shared_frame;
+    if(sf) {
+        sf->have_sums = 0;
+        for(i=0; i<FLAC_MAX_CH; i++) {
+            sf->wasted[i] = -1;
+            sf->autoc_order[i] = 0;
+        }
+    }
+
+    fs = encode_block(ctx, in, block_size, sf, t_in);
+    if(fs > 0) {
+        for(i=0; i<ctx->output_count; i++) {
+            if(feed_output(ctx->outputs[i], in, block_size, sf,
+                           t_in) < 0)
+                return -1;
+        }
+        if(ctx->last_frame && flake_flush_outputs(s) < 0)
+            return -1;
+    }
+    return fs;
+}
+
+/**
+ * Wrap a buffer of interleaved int32 samples as an input block
+ */
+static void
+s32_input(InputBlock *in, const int32_t *samples)
+{
+    in->format = INPUT_S32;
+    in->data = samples;
+    in->offset = 0;
+}
+
 int
 flake_encode_frame(FlakeContext *s, const int *samples, int block_size)
 {
-    int fs;
+    InputBlock in;
+
+    if(!s || !samples || !s->private_ctx)
+        return -1;
+    s32_input(&in, samples);
+    return encode_frame_at(s, &in, block_size, speed_get_wall_time());
+}
+
+int
+flake_encode_frame_planar(FlakeContext *s, const int *const *samples,
+                          int block_size)
+{
+    int ch;
+    InputBlock in;
     FlacEncodeContext *ctx;
 
     if(!s || !samples || !s->private_ctx)
         return -1;
     ctx = (FlacEncodeContext *) s->private_ctx;
+    for(ch=0; ch<ctx->channels; ch++) {
+        if(!samples[ch])
+            return -1;
+    }
 
-    if(block_size < 1 || block_size > ctx->params.block_size)
+    in.format = INPUT_PLANAR;
+    in.data = samples;
+    in.offset = 0;
+    return encode_frame_at(s, &in, block_size, speed_get_wall_time());
+}
+
+int
+flake_encode_frame_s16(FlakeContext *s, const short *samples, int block_size)
+{
+    InputBlock in;
+    FlacEncodeContext *ctx;
+
+    if(!s || !samples || !s->private_ctx)
         return -1;
-    if(ctx->last_frame)
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    // the MD5 input is 2 bytes per sample
+    if(ctx->bps <= 8 || ctx->bps > 16)
         return -1;
-    if(!ctx->params.allow_vbs && block_size != ctx->params.block_size)
-        ctx->last_frame = 1;
 
-    fs = -1;
-    if((ctx->params.variable_block_size > 0) &&
-       !(block_size % VBS_MAX_FRAMES) && block_size >= VBS_MIN_BLOCK_SIZE) {
-        fs = encode_frame_vbs(ctx, samples, block_size);
+    in.format = INPUT_S16;
+    in.data = samples;
+    in.offset = 0;
+    return encode_frame_at(s, &in, block_size, speed_get_wall_time());
+}
+
+int
+flake_encode_frame_s24(FlakeContext *s, const unsigned char *samples,
+                       int block_size)
+{
+    InputBlock in;
+    FlacEncodeContext *ctx;
+
+    if(!s || !samples || !s->private_ctx)
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    // the MD5 input is 3 bytes per sample
+    if(ctx->bps <= 16 || ctx->bps > 24)
+        return -1;
+
+    in.format = INPUT_S24;
+    in.data = samples;
+    in.offset = 0;
+    return encode_frame_at(s, &in, block_size, speed_get_wall_time());
+}
+
+int
+flake_encode_push(FlakeContext *s, const int *samples, int n)
+{
+    int k, fs, bs, ch, bytes;
+    double t_in;
+    InputBlock in;
+    FlacEncodeContext *ctx;
+
+    if(!s || !s->private_ctx || n < 0 || (n && !samples))
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(ctx->driver || ctx->last_frame || !ctx->write_frame)
+        return -1;
+
+    bs = ctx->params.block_size;
+    ch = ctx->channels;
+    if(!ctx->fifo) {
+        ctx->fifo = mem_alloc(&ctx->mem, bs * ch * sizeof(int32_t));
+        if(!ctx->fifo)
+            return -1;
     }
-    if(fs < 0) {
-        fs = encode_frame(ctx, ctx->frame_buffer, ctx->frame_buffer_size, samples,
-                          block_size);
+
+    t_in = speed_get_wall_time();
+    bytes = 0;
+    while(n > 0) {
+        if(!ctx->fifo_len && n >= bs) {
+            // a whole block is encoded from the input without a copy
+            s32_input(&in, samples);
+            fs = encode_frame_at(s, &in, bs, t_in);
+            samples += bs * ch;
+            n -= bs;
+        } else {
+            if(!ctx->fifo_len)
+                ctx->fifo_time = t_in;
+            k = MIN(n, bs - ctx->fifo_len);
+            memcpy(&ctx->fifo[ctx->fifo_len*ch], samples, k * ch * sizeof(int32_t));
+            ctx->fifo_len += k;
+            samples += k * ch;
+            n -= k;
+            if(ctx->fifo_len < bs)
+                break;
+            ctx->fifo_len = 0;
+            s32_input(&in, ctx->fifo);
+            fs = encode_frame_at(s, &in, bs, ctx->fifo_time);
+        }
+        if(fs < 0)
+            return -1;
+        bytes += fs;
+    }
+    return bytes;
+}
+
+int
+flake_encode_finish(FlakeContext *s)
+{
+    int n, fs;
+    InputBlock in;
+    FlacEncodeContext *ctx;
+
+    if(!s || !s->private_ctx)
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(ctx->driver)
+        return -1;
+
+    fs = 0;
+    if(ctx->fifo_len > 0 && !ctx->last_frame) {
+        n = ctx->fifo_len;
+        ctx->fifo_len = 0;
+        s32_input(&in, ctx->fifo);
+        fs = encode_frame_at(s, &in, n, ctx->fifo_time);
+        if(fs < 0)
+            return -1;
+    }
+    if(!ctx->last_frame) {
+        ctx->last_frame = 1;
+        if(flake_flush_outputs(s) < 0)
+            return -1;
     }
-    if(fs > 0)
-        md5_accumulate(&ctx->md5ctx, samples, ctx->channels, ctx->bps, block_size);
     return fs;
 }
 
+int
+flake_add_output(FlakeContext *s, FlakeContext *out)
+{
+    FlacEncodeContext *ctx, *octx;
+
+    if(!s || !out || !s->private_ctx || !out->private_ctx || s == out)
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    octx = (FlacEncodeContext *) out->private_ctx;
+
+    if(ctx->driver || octx->driver || octx->output_count ||
+       ctx->output_count >= FLAKE_MAX_OUTPUTS || !octx->write_frame)
+        return -1;
+    if(octx->channels != ctx->channels || octx->samplerate != ctx->samplerate ||
+       octx->bps != ctx->bps)
+        return -1;
+    if(ctx->stats.frames || octx->stats.frames)
+        return -1;
+
+    if(!ctx->shared_frame) {
+        ctx->shared_frame = mem_calloc(&ctx->mem, 1, sizeof(SharedFrame));
+        if(!ctx->shared_frame)
+            return -1;
+    }
+    // an output reset after its driver closed keeps its buffer
+    if(!octx->fifo)
+        octx->fifo = mem_alloc(&octx->mem, octx->params.block_size *
+                               octx->channels * sizeof(int32_t));
+    if(!octx->fifo)
+        return -1;
+    octx->fifo_len = 0;
+    octx->driver = ctx;
+    ctx->outputs[ctx->output_count++] = octx;
+    return 0;
+}
+
+int
+flake_flush_outputs(FlakeContext *s)
+{
+    int i;
+    InputBlock in;
+    FlacEncodeContext *ctx, *out;
+
+    if(!s || !s->private_ctx)
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+
+    for(i=0; i<ctx->output_count; i++) {
+        out = ctx->outputs[i];
+        if(out->fifo_len > 0) {
+            out->last_frame = 1;
+            s32_input(&in, out->fifo);
+            if(encode_block(out, &in, out->fifo_len, NULL,
+                            out->fifo_time) < 0)
+                return -1;
+            out->fifo_len = 0;
+        }
+    }
+    return 0;
+}
+
+int
+flake_set_frame_callback(FlakeContext *s, FlakeWriteFrame write_frame,
+                         void *opaque)
+{
+    FlacEncodeContext *ctx;
+
+    if(!s || !s->private_ctx)
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(ctx->sink_buffer && flush_sink(ctx))
+        return -1;
+    ctx->write_frame = write_frame;
+    ctx->write_opaque = opaque;
+    ctx->sink_seek = NULL;
+    ctx->sink_buffer = NULL;
+    return 0;
+}
+
+int
+flake_set_output_sink(FlakeContext *s, const FlakeOutputSink *sink)
+{
+    FlacEncodeContext *ctx;
+
+    if(!s || !s->private_ctx || !sink || !sink->write)
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(sink->buffer && sink->buffer_size < ctx->frame_buffer_size)
+        return -1;
+    if(ctx->sink_buffer && flush_sink(ctx))
+        return -1;
+
+    ctx->write_frame = sink->write;
+    ctx->write_opaque = sink->opaque;
+    ctx->sink_seek = sink->seek;
+    ctx->sink_buffer = sink->buffer;
+    ctx->sink_size = sink->buffer_size;
+    ctx->sink_fill = 0;
+    ctx->sink_frames = 0;
+    return 0;
+}
+
+int
+flake_finish_output(FlakeContext *s)
+{
+    FlacEncodeContext *ctx;
+    FlakeStreaminfo strminfo;
+    uint8_t data[34];
+
+    if(!s || !s->private_ctx)
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(ctx->sink_buffer && flush_sink(ctx))
+        return -1;
+
+    // STREAMINFO follows the "fLaC" marker and its block header
+    if(!ctx->sink_seek)
+        return 0;
+    if(ctx->sink_seek(ctx->write_opaque, 8))
+        return -1;
+    if(flake_get_streaminfo(s, &strminfo))
+        return -1;
+    flake_write_streaminfo(&strminfo, data);
+    if(ctx->write_frame(ctx->write_opaque, data, 34) < 0)
+        return -1;
+    return 1;
+}
+
+double
+flake_get_latency(const FlakeEncodeStats *stats, double percent)
+{
+    int i;
+    unsigned int total, count;
+
+    if(!stats || !stats->frames)
+        return 0.0;
+    total = 0;
+    for(i=0; i<FLAKE_LATENCY_BINS; i++)
+        total += stats->latency[i];
+    count = 0;
+    for(i=0; i<FLAKE_LATENCY_BINS-1; i++) {
+        count += stats->latency[i];
+        if(count >= total * percent / 100.0)
+            break;
+    }
+    return pow(2.0, (i + 1) / 4.0);
+}
+
+int
+flake_get_stats(const FlakeContext *s, FlakeEncodeStats *stats)
+{
+    FlacEncodeContext *ctx;
+
+    if(!s || !stats || !s->private_ctx)
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    *stats = ctx->stats;
+    return 0;
+}
+
+int
+flake_get_memory_usage(const FlakeContext *s, size_t *current, size_t *peak)
+{
+    FlacEncodeContext *ctx;
+
+    if(!s || !s->private_ctx)
+        return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(current) *current = ctx->mem.current;
+    if(peak) *peak = ctx->mem.peak;
+    return 0;
+}
+
 void
 flake_encode_close(FlakeContext *s)
 {
-    FlacEncodeContext *ctx;
+    int i;
+    FlacEncodeContext *ctx, *drv;
+    MemContext mem;
 
     if(s == NULL) return;
     if(s->private_ctx == NULL) return;
     ctx = (FlacEncodeContext *) s->private_ctx;
     if(ctx) {
-        if(ctx->bw) free(ctx->bw);
-        if(ctx->frame_buffer) free(ctx->frame_buffer);
+        // outputs keep the final checksum of their driver
+        detach_outputs(ctx);
+        if(ctx->driver) {
+            drv = ctx->driver;
+            for(i=0; i<drv->output_count; i++) {
+                if(drv->outputs[i] == ctx)
+                    drv->outputs[i] = drv->outputs[--drv->output_count];
+            }
+        }
+        // frames still in the sink buffer are passed on
+        if(ctx->sink_buffer)
+            flush_sink(ctx);
+        mem_free(&ctx->mem, ctx->bw);
+        mem_free(&ctx->mem, ctx->frame_buffer);
+        mem_free(&ctx->mem, ctx->vbs_buffer);
+        mem_free(&ctx->mem, ctx->shared_frame);
+        mem_free(&ctx->mem, ctx->fifo);
+        mem_free(&ctx->mem, s->header);
         md5_close(&ctx->md5ctx);
-        free(ctx);
+        lpc_close(&ctx->lpc);
+        // the context frees itself
+        mem = ctx->mem;
+        mem_free(&mem, ctx);
     }
-    if(s->header) free(s->header);
+    s->header = NULL;
     s->private_ctx = NULL;
 }
 
@@ -27,6 +27,7 @@
 #include "rice.h"
 #include "lpc.h"
 #include "md5.h"
+#include "mem.h"
 
 #define FLAKE_VERSION "SVN"
 
@@ -47,6 +48,9 @@
 
 #define FLAC_STREAM_MARKER  0x664C6143
 
+/** most frames held in the sink buffer before it is passed on */
+#define SINK_MAX_FRAMES 256
+
 struct BitWriter;
 
 typedef struct FlacSubframe {
@@ -71,6 +75,61 @@ typedef struct FlacFrame {
     FlacSubframe subframes[FLAC_MAX_CH];
 } FlacFrame;
 
+/**
+ * LPC decision from the previous frame for each signal, used to seed the log
+ * order search.  Signals are indexed as returned by channel_source(), so
+ * left, right, mid and side each keep their own history whichever channel
+ * codes them.  An order of 0 means there is no history.
+ */
+typedef struct LpcHistory {
+    int order[FLAC_MAX_CH];
+    int blocksize[FLAC_MAX_CH];
+    uint32_t bits[FLAC_MAX_CH];
+} LpcHistory;
+
+/**
+ * Analysis passed to the sub-block candidates of the VBS search
+ * The stereo decorrelation sums are combined from smaller sub-blocks, and
+ * the LPC coefficients of the enclosing block are tried as one more
+ * candidate.  The LPC fields are indexed by signal, as returned by
+ * channel_source().  An order of 0 means there are no parent coefficients
+ * for that signal.
+ */
+typedef struct FrameHint {
+    uint64_t decorr_sums[4];
+    int order[FLAC_MAX_CH];
+    int shift[FLAC_MAX_CH];
+    int32_t coefs[FLAC_MAX_CH][MAX_LPC_ORDER];
+} FrameHint;
+
+/**
+ * Analysis of the current block of input, shared by the outputs of an
+ * encoder which code it as one frame.  Each part is computed by the first
+ * output which needs it.  Signals are indexed as returned by
+ * channel_source().
+ */
+typedef struct SharedFrame {
+    int have_sums;
+    uint64_t decorr_sums[4];
+    int wasted[FLAC_MAX_CH];        ///< -1 if not yet known
+    int autoc_order[FLAC_MAX_CH];   ///< 0 if not yet computed
+    int autoc_nwin[FLAC_MAX_CH];
+    const LpcContext *autoc_lpc[FLAC_MAX_CH]; ///< windows of the data
+    double autoc[FLAC_MAX_CH][LPC_MAX_WINDOWS][MAX_LPC_ORDER+1];
+} SharedFrame;
+
+/**
+ * Compression levels available to meet the target speed, and the measured
+ * cost of each.
+ */
+typedef struct SpeedControl {
+    int levels;
+    int level;                  ///< level used for the next frame
+    FlakeEncodeParams params[13];
+    double cost[13];            ///< seconds per sample, 0 if not measured
+    double credit;              ///< seconds ahead of the target speed
+} SpeedControl;
+
 typedef struct FlacEncodeContext {
     int channels;
     int ch_code;
@@ -78,21 +137,96 @@ typedef struct FlacEncodeContext {
     int sr_code[2];
     int bps;
     int bps_code;
-    uint32_t sample_count;
+    uint64_t sample_count;
     FlakeEncodeParams params;
     int max_frame_size;
     int lpc_precision;
-    uint32_t frame_count;
+    LpcContext lpc;
+    uint64_t frame_count;       ///< frame number, or sample number with VBS
     FlacFrame frame;
     MD5Context md5ctx;
     struct BitWriter *bw;
     uint8_t *frame_buffer;
     int frame_buffer_size;
+    uint8_t *frame_out;         ///< where frames are encoded: frame_buffer or
+                                ///< the sink buffer
+    uint8_t *vbs_buffer;        ///< encoded sub-block candidates for VBS search
+    int vbs_buffer_size;
     int last_frame;
+    LpcHistory last;
+    const FrameHint *hint;      ///< set only while encoding VBS candidates
+    SpeedControl speed;
+    FlakeEncodeStats stats;
+    FlakeWriteFrame write_frame;
+    void *write_opaque;
+    int (*sink_seek)(void *opaque, uint64_t pos);
+    uint8_t *sink_buffer;       ///< caller buffer collecting frames, if any
+    int sink_size;
+    int sink_fill;
+    int sink_frames;
+    double sink_time[SINK_MAX_FRAMES]; ///< input time of each frame in the
+                                       ///< sink buffer
+    SharedFrame *shared;        ///< set only while encoding a shared frame
+    SharedFrame *shared_frame;  ///< analysis for the outputs, if any
+    struct FlacEncodeContext *outputs[FLAKE_MAX_OUTPUTS];
+    int output_count;
+    struct FlacEncodeContext *driver; ///< encoder feeding this output
+    int32_t *fifo;              ///< input buffered by an output, or pushed
+    int fifo_len;
+    double fifo_time;           ///< wall time the first sample in fifo came in
+    int have_md5sum;            ///< md5sum is set after the driver closes
+    uint8_t md5sum[16];
     FlakeContext *parent;
+    MemContext mem;             ///< all memory of the encoder, and its count
 } FlacEncodeContext;
 
+/**
+ * Identify the signal coded in a channel: its own input channel, or the mid
+ * (2) or side (3) signal of a stereo pair.
+ */
+static inline int
+channel_source(int ch_mode, int ch)
+{
+    switch(ch_mode) {
+        case FLAC_CHMODE_LEFT_SIDE:  return ch ? 3 : 0;
+        case FLAC_CHMODE_RIGHT_SIDE: return ch ? 1 : 3;
+        case FLAC_CHMODE_MID_SIDE:   return ch ? 3 : 2;
+    }
+    return ch;
+}
+
+/**
+ * A block of input samples in one of the layouts accepted by the API.  It
+ * starts offset samples per channel into data, so that a block can be split
+ * without copying it.
+ */
+typedef struct InputBlock {
+    enum {
+        INPUT_S32,              ///< interleaved int32
+        INPUT_PLANAR,           ///< one int32 buffer per channel
+        INPUT_S16,              ///< interleaved int16, native byte order
+        INPUT_S24               ///< interleaved packed 24-bit little-endian
+    } format;
+    const void *data;
+    int offset;
+} InputBlock;
+
 extern int encode_frame(FlacEncodeContext *s, uint8_t *frame_buffer,
-                        int buf_size, const int32_t *samples, int block_size);
+                        int buf_size, const InputBlock *in, int block_size);
+
+/**
+ * Copy block_size samples of input into the subframes, one buffer per
+ * channel, widened to int32
+ */
+extern void copy_input(FlacEncodeContext *ctx, const InputBlock *in,
+                       int block_size);
+
+/**
+ * Sum the magnitude of the 2nd order residual of the left, right, mid and
+ * side signals for samples start to end-1.  start must be at least 2.
+ * stride is the distance between samples of one channel.
+ */
+extern void calc_decorr_sums(const int32_t *left_ch, const int32_t *right_ch,
+                             int stride, int start, int end, uint64_t sum[4]);
 
 #endif /* FLAC_H */
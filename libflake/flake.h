@@ -20,6 +20,9 @@
 #ifndef FLAKE_H
 #define FLAKE_H
 
+#include <stddef.h>
+#include <inttypes.h>
+
 /* shared library API export */
 #if defined(_WIN32) && !defined(_XBOX)
  #if defined(FLAKE_BUILD_LIBRARY)
@@ -42,14 +45,23 @@ typedef enum {
     FLAKE_ORDER_METHOD_4LEVEL,
     FLAKE_ORDER_METHOD_8LEVEL,
     FLAKE_ORDER_METHOD_SEARCH,
-    FLAKE_ORDER_METHOD_LOG
+    FLAKE_ORDER_METHOD_LOG,
+    FLAKE_ORDER_METHOD_MODEL
 } FlakeOrderMethod;
 
 typedef enum {
     FLAKE_STEREO_METHOD_INDEPENDENT,
-    FLAKE_STEREO_METHOD_ESTIMATE
+    FLAKE_STEREO_METHOD_ESTIMATE,
+    FLAKE_STEREO_METHOD_EXACT
 } FlakeStereoMethod;
 
+typedef enum {
+    FLAKE_WINDOW_WELCH         = 0x01,
+    FLAKE_WINDOW_HANN          = 0x02,
+    FLAKE_WINDOW_TUKEY         = 0x04,
+    FLAKE_WINDOW_PARTIAL_TUKEY = 0x08
+} FlakeWindow;
+
 typedef enum {
     FLAKE_PREDICTION_NONE,
     FLAKE_PREDICTION_FIXED,
@@ -74,7 +86,7 @@ typedef struct FlakeEncodeParams {
     /**
      * prediction order selection method
      * if set to less than 0, it is chosen based on compression.
-     * valid values are 0 to 6
+     * valid values are 0 to 7
      * 0 = use maximum order only
      * 1 = use estimation
      * 2 = 2-level
@@ -82,6 +94,7 @@ typedef struct FlakeEncodeParams {
      * 4 = 8-level
      * 5 = full search
      * 6 = log search
+     * 7 = model-based search
      */
     int order_method;
 
@@ -90,7 +103,9 @@ typedef struct FlakeEncodeParams {
      * if set to less than 0, it is chosen based on compression.
      * valid values are 0 to 2
      * 0 = independent L+R channels
-     * 1 = mid-side encoding
+     * 1 = mid-side encoding, mode estimated from 2nd order residual
+     * 2 = mid-side encoding, left, right, mid and side are each fully
+     *     encoded and the smallest pair is used
      */
     int stereo_method;
 
@@ -147,7 +162,8 @@ typedef struct FlakeEncodeParams {
      * if set to 1, libflake will automatically split each frame into smaller
      * frames in order to improve compression
      * 0 = fixed block size
-     * 1 = variable block size
+     * 1 = variable block size, split by a predictability heuristic
+     * 2 = variable block size, smallest encoding of all aligned splits
      */
     int variable_block_size;
 
@@ -158,8 +174,79 @@ typedef struct FlakeEncodeParams {
      */
     int allow_vbs;
 
+    /**
+     * fixed-prediction screen before LPC analysis
+     * if set greater than 0, the best fixed predictor is measured first and
+     * LPC analysis is skipped when the gain it is expected to add, less the
+     * cost of its coefficients, is below this many tenths of a percent of
+     * the fixed-prediction subframe size.
+     * valid values are 0 to 100
+     * 0 = always run LPC analysis (default)
+     */
+    int fixed_screen;
+
+    /**
+     * apodization windows for LPC analysis
+     * mask of FlakeWindow flags.  if more than one window is set, LPC
+     * coefficients are computed for each window and the smallest result is
+     * used.  a partial Tukey window counts as two windows, one on each half
+     * of the block.
+     * valid values are 0 to 15
+     * 1 = Welch window only (default)
+     * 0 = treated as Welch
+     */
+    int apodization;
+
+    /**
+     * percentage of Tukey and partial Tukey windows which is tapered
+     * valid values are 0 to 100 (default: 50)
+     */
+    int tukey_p;
+
+    /**
+     * precision of windowed samples in LPC analysis
+     * single precision allows a faster autocorrelation and selects the same
+     * coefficients in nearly all frames.  the output is always lossless.
+     * 0 = double precision (default)
+     * 1 = single precision
+     */
+    int float_analysis;
+
+    /**
+     * target encoding speed, as a multiple of realtime for one CPU core
+     * if set greater than 0, the encoder measures the time taken by each
+     * frame and moves between compression levels 0 to compression to keep
+     * up with the target, using the highest level it can afford.  block size
+     * and variable block size are never raised above the parameters given.
+     * the level used for each frame is counted in FlakeEncodeStats.
+     * 0 = fixed parameters (default)
+     */
+    int target_speed;
+
+    /**
+     * low-latency profile
+     * set by flake_set_low_latency.  when set, parameters which make the
+     * analysis time of a frame unbounded or which buffer audio across frames
+     * are rejected by flake_validate_params.
+     * 0 = off (default)
+     * 1 = on
+     */
+    int low_latency;
+
 } FlakeEncodeParams;
 
+/**
+ * Memory allocator
+ * alloc returns a block of at least size bytes, aligned for any type, or
+ * NULL if it fails.  free releases a block returned by alloc, and is never
+ * called with NULL.  Both are called from the thread using the encoder.
+ */
+typedef struct FlakeAllocator {
+    void *(*alloc)(void *opaque, size_t size);
+    void (*free)(void *opaque, void *ptr);
+    void *opaque;
+} FlakeAllocator;
+
 typedef struct FlakeContext {
 
     /**
@@ -185,9 +272,10 @@ typedef struct FlakeContext {
     /**
      * total stream samples
      * set by user prior to calling flake_encode_init
-     * if 0, stream length is unknown
+     * if 0, stream length is unknown.  FLAC stores up to 36 bits, and a
+     * longer stream is written as unknown.
      */
-    unsigned int samples;
+    uint64_t samples;
 
     /**
      * encoding parameters
@@ -196,6 +284,14 @@ typedef struct FlakeContext {
      */
     FlakeEncodeParams params;
 
+    /**
+     * memory allocator
+     * set by user prior to calling flake_encode_init, which copies it.  if
+     * NULL, malloc and free are used.  all memory of the encoder, including
+     * the header, is allocated through it.
+     */
+    const FlakeAllocator *allocator;
+
     /**
      * header bytes
      * allocated by flake_encode_init and freed by flake_encode_close
@@ -216,6 +312,16 @@ typedef struct FlakeContext {
  */
 FLAKE_API int flake_set_defaults(FlakeEncodeParams *params);
 
+/**
+ * Applies the low-latency profile on top of the current parameters
+ * Sets a block size of 256 samples, which is within the FLAC Subset, and
+ * limits the analysis to a single residual evaluation per channel: order
+ * method estimate or max, at most order 12, a single apodization window,
+ * estimated stereo mode, and no variable block size or target speed.
+ * Should be called after flake_set_defaults.
+ */
+FLAKE_API int flake_set_low_latency(FlakeEncodeParams *params);
+
 /**
  * Validates encoding parameters
  * @return -1 if error. 0 if ok. 1 if ok but non-Subset.
@@ -224,15 +330,209 @@ FLAKE_API int flake_validate_params(const FlakeContext *s);
 
 FLAKE_API int flake_encode_init(FlakeContext *s);
 
+/**
+ * Reinitializes an encoder for a new stream, keeping its buffers
+ * The fields of s are set by the user as for flake_encode_init.  channels,
+ * bits_per_sample and params.block_size must be unchanged; the sample rate,
+ * length and other parameters can differ.  The frame callback or output
+ * sink is kept, and frames still in the sink buffer are passed on first.
+ * s cannot be an output.  Its outputs are detached as by flake_encode_close,
+ * and can be finished, reset and added again.
+ * @return size of the new header in s->header, or -1 if error
+ */
+FLAKE_API int flake_encode_reset(FlakeContext *s);
+
 FLAKE_API void *flake_get_buffer(const FlakeContext *s);
 
+/**
+ * Returns the size of the frame buffer, which is the largest size an encoded
+ * frame can take
+ */
+FLAKE_API int flake_get_buffer_size(const FlakeContext *s);
+
+/**
+ * Frame output callback
+ * Called by flake_encode_frame with the encoded data as soon as it is
+ * complete.  It must return 0, or a negative value to make
+ * flake_encode_frame fail.
+ */
+typedef int (*FlakeWriteFrame)(void *opaque, const unsigned char *data,
+                               int size);
+
+/**
+ * Sets the frame output callback, or clears it if write_frame is NULL
+ * Must be called after flake_encode_init.  The data is still returned in
+ * the buffer from flake_get_buffer.
+ */
+FLAKE_API int flake_set_frame_callback(FlakeContext *s,
+                                       FlakeWriteFrame write_frame,
+                                       void *opaque);
+
+/**
+ * Output sink
+ * write receives the encoded frames, as the frame callback does.  If buffer
+ * is set, frames are encoded directly into it, one after another, and write
+ * is called with all of them when the next frame might not fit or 256 frames
+ * are held, and by flake_finish_output.  The buffer is then reused.  It must
+ * hold at least flake_get_buffer_size bytes, and a larger one gives fewer,
+ * larger writes.
+ * If seek is set, flake_finish_output uses it to move to an absolute
+ * position in the output and rewrite STREAMINFO; it returns 0 if ok.
+ */
+typedef struct FlakeOutputSink {
+    FlakeWriteFrame write;
+    int (*seek)(void *opaque, uint64_t pos);
+    void *opaque;
+    unsigned char *buffer;
+    int buffer_size;
+} FlakeOutputSink;
+
+/**
+ * Sets the output sink, which replaces the frame callback
+ * Must be called after flake_encode_init.  The header from flake_encode_init
+ * is not passed to the sink, and must be written first by the caller.
+ * With a sink buffer, the buffer from flake_get_buffer is not used, and in
+ * low-latency mode the buffer is passed on after every frame.
+ * @return 0 if ok, -1 if error
+ */
+FLAKE_API int flake_set_output_sink(FlakeContext *s,
+                                    const FlakeOutputSink *sink);
+
+/**
+ * Passes on the frames left in the sink buffer, then rewrites STREAMINFO
+ * through the sink if it can seek.  The output is left after STREAMINFO.
+ * @return 1 if STREAMINFO was rewritten, 0 if the sink has no seek
+ *         callback, -1 if error, including a failed seek
+ */
+FLAKE_API int flake_finish_output(FlakeContext *s);
+
 FLAKE_API int flake_encode_frame(FlakeContext *s, const int *samples,
                                  int block_size);
 
+/**
+ * Encodes a frame from separate channel buffers
+ * samples holds one pointer per channel, each to block_size samples.
+ * Otherwise the same as flake_encode_frame.  Each channel is copied into
+ * the frame directly and the MD5 checksum is computed from the buffers.
+ * This also holds with variable block size and added outputs, except that
+ * an output whose block size differs buffers its partial frame as int32.
+ */
+FLAKE_API int flake_encode_frame_planar(FlakeContext *s,
+                                        const int *const *samples,
+                                        int block_size);
+
+/**
+ * Encodes a frame from interleaved 16-bit samples in native byte order
+ * Otherwise the same as flake_encode_frame.  The samples are widened as
+ * they are copied into the frame, and on little-endian systems the MD5
+ * checksum is computed from the input bytes directly.  bits_per_sample must
+ * be from 9 to 16.
+ */
+FLAKE_API int flake_encode_frame_s16(FlakeContext *s, const short *samples,
+                                     int block_size);
+
+/**
+ * Encodes a frame from interleaved packed 24-bit little-endian samples,
+ * 3 bytes each
+ * Otherwise the same as flake_encode_frame_s16.  bits_per_sample must be
+ * from 17 to 24.
+ */
+FLAKE_API int flake_encode_frame_s24(FlakeContext *s,
+                                     const unsigned char *samples,
+                                     int block_size);
+
+/**
+ * Encodes samples of any count, buffering them into frames of
+ * params.block_size samples.  With variable block size, each whole block is
+ * split as with flake_encode_frame.  Frames are passed to the frame
+ * callback, which must be set, as one call can output several frames or
+ * none.  flake_encode_frame cannot be called while samples are buffered.
+ * @param samples channel-interleaved input
+ * @param n number of samples per channel
+ * @return number of bytes output, or -1 if error
+ */
+FLAKE_API int flake_encode_push(FlakeContext *s, const int *samples, int n);
+
+/**
+ * Encodes the samples still buffered by flake_encode_push as the last frame,
+ * and those buffered for the outputs of s.  No more samples can be encoded
+ * afterwards.
+ * @return number of bytes output, or -1 if error
+ */
+FLAKE_API int flake_encode_finish(FlakeContext *s);
+
+/** maximum number of outputs added to one encoder */
+#define FLAKE_MAX_OUTPUTS 8
+
+/**
+ * Adds another output stream to an encoder
+ * out must be initialized for the same channels, sample rate and bits per
+ * sample as s, and must have a frame callback.  Each call to
+ * flake_encode_frame on s then also encodes the samples with the parameters
+ * of out, buffered into frames of its own block size.  The input and its
+ * MD5 checksum are handled once, and when the frames of both have the same
+ * size, the stereo and wasted bits analysis and the autocorrelation for
+ * matching windows and prediction orders are computed once.  out cannot be
+ * passed to flake_encode_frame itself.
+ * @return 0 if ok, -1 if error
+ */
+FLAKE_API int flake_add_output(FlakeContext *s, FlakeContext *out);
+
+/**
+ * Encodes the samples still buffered for the outputs of s
+ * Call it after the last frame if it was a whole block.  This is done
+ * automatically when the last frame is shorter than the block size.
+ */
+FLAKE_API int flake_flush_outputs(FlakeContext *s);
+
 FLAKE_API void flake_encode_close(FlakeContext *s);
 
 FLAKE_API const char *flake_get_version(void);
 
+/** latency histogram bins: 4 per octave from 1 microsecond to 16 seconds */
+#define FLAKE_LATENCY_BINS 96
+
+/**
+ * Encoding statistics
+ * Updated by flake_encode_frame for each frame encoded.
+ */
+typedef struct FlakeEncodeStats {
+    unsigned int frames;
+    uint64_t samples;
+    uint64_t bytes;
+    double encode_time;                 ///< CPU seconds in flake_encode_frame
+    unsigned int level_frames[13];      ///< frames encoded at each compression
+                                        ///< level when target_speed is set.
+                                        ///< otherwise, all frames are counted
+                                        ///< at params.compression.
+    unsigned int latency[FLAKE_LATENCY_BINS]; ///< frames by wall-clock time
+                                        ///< from the call which passed in
+                                        ///< their first sample until they
+                                        ///< are passed to the frame callback
+                                        ///< or sink, or returned
+} FlakeEncodeStats;
+
+FLAKE_API int flake_get_stats(const FlakeContext *s, FlakeEncodeStats *stats);
+
+/**
+ * Gets the memory used by an encoder, in bytes requested from its allocator
+ * current is the memory allocated now, and peak the most allocated at once
+ * since flake_encode_init, including the temporary buffers used while
+ * encoding a frame.  Either pointer can be NULL.
+ * @return 0 if ok, -1 if error
+ */
+FLAKE_API int flake_get_memory_usage(const FlakeContext *s, size_t *current,
+                                     size_t *peak);
+
+/**
+ * Returns the frame latency in microseconds below which the given
+ * percentage of frames were output, from FlakeEncodeStats.latency.
+ * The result is the upper edge of a histogram bin, so it is accurate to
+ * within 19%.
+ */
+FLAKE_API double flake_get_latency(const FlakeEncodeStats *stats,
+                                   double percent);
+
 /**
  * FLAC Streaminfo Metadata
  */
@@ -244,7 +544,7 @@ typedef struct FlakeStreaminfo {
     unsigned int sample_rate;
     unsigned int channels;
     unsigned int bits_per_sample;
-    unsigned int samples;
+    uint64_t samples;
     unsigned char md5sum[16];
 } FlakeStreaminfo;
 
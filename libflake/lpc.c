@@ -22,38 +22,128 @@
 #include "flake.h"
 #include "lpc.h"
 
+#ifdef HAVE_AVX2_INTRINSICS
+#include <immintrin.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/** internal window types.  a partial Tukey window is split in two halves. */
+enum {
+    WINDOW_WELCH,
+    WINDOW_HANN,
+    WINDOW_TUKEY,
+    WINDOW_PARTIAL_TUKEY_1,
+    WINDOW_PARTIAL_TUKEY_2
+};
+
 /**
- * Apply Welch window function to audio block
+ * Generate Welch window function
  */
-static inline void
-apply_welch_window(const int32_t *data, int len, double *w_data)
+static void
+window_welch(double *w, int len)
 {
     int i;
     double c;
 
     c = (2.0 / (len - 1.0)) - 1.0;
     for(i=0; i<(len >> 1); i++) {
-        double w = 1.0 - ((c-i) * (c-i));
-        w_data[i] = data[i] * w;
-        w_data[len-1-i] = data[len-1-i] * w;
+        w[i] = w[len-1-i] = 1.0 - ((c-i) * (c-i));
+    }
+    if(len & 1) {
+        w[i] = 1.0 - ((c-i) * (c-i));
+    }
+}
+
+/**
+ * Generate Tukey window function over samples start to end-1 with p percent
+ * of it tapered.  Samples outside of the range are set to zero.
+ * p = 0 gives a rectangular window and p = 100 gives a Hann window.
+ */
+static void
+window_tukey(double *w, int len, int start, int end, int p)
+{
+    int i, n, np;
+
+    for(i=0; i<start; i++) w[i] = 0.0;
+    for(i=end; i<len; i++) w[i] = 0.0;
+
+    n = end - start;
+    np = (p * (n - 1)) / 200;
+    for(i=0; i<n; i++) {
+        w[start+i] = 1.0;
+    }
+    for(i=0; i<np; i++) {
+        double v = 0.5 - 0.5 * cos(M_PI * i / np);
+        w[start+i] = v;
+        w[end-1-i] = v;
+    }
+}
+
+/**
+ * Get a window function from the context cache, generating it if needed
+ */
+static const double *
+get_window(LpcContext *lpc, int type, int len)
+{
+    int i;
+    LpcWindow *win;
+
+    for(i=0; i<LPC_WINDOW_CACHE_SIZE; i++) {
+        win = &lpc->cache[i];
+        if(win->data && win->type == type && win->len == len) {
+            return win->data;
+        }
+    }
+
+    // replace cache entries in round-robin order
+    win = &lpc->cache[lpc->next_slot];
+    lpc->next_slot = (lpc->next_slot + 1) % LPC_WINDOW_CACHE_SIZE;
+    if(win->size < len) {
+        mem_free(lpc->mem, win->data);
+        win->data = mem_alloc(lpc->mem, len * sizeof(double));
+        if(!win->data) {
+            win->size = 0;
+            return NULL;
+        }
+        win->size = len;
+    }
+    win->type = type;
+    win->len = len;
+
+    switch(type) {
+        case WINDOW_WELCH:
+            window_welch(win->data, len);
+            break;
+        case WINDOW_HANN:
+            window_tukey(win->data, len, 0, len, 100);
+            break;
+        case WINDOW_TUKEY:
+            window_tukey(win->data, len, 0, len, lpc->tukey_p);
+            break;
+        case WINDOW_PARTIAL_TUKEY_1:
+            window_tukey(win->data, len, 0, len >> 1, lpc->tukey_p);
+            break;
+        case WINDOW_PARTIAL_TUKEY_2:
+            window_tukey(win->data, len, len >> 1, len, lpc->tukey_p);
+            break;
     }
+    return win->data;
 }
 
 /**
- * Calculates autocorrelation data from audio samples
- * A Welch window function is applied before calculation.
+ * Calculates autocorrelation data from windowed audio samples
+ * Direct summation is used for all block sizes.  With at most 33 lags, an
+ * FFT-based autocorrelation is slower even for the largest FLAC blocks.
  */
 static void
-compute_autocorr(const int32_t *data, int len, int lag, double *autoc)
+compute_autocorr(const double *data1, int len, int lag, double *autoc)
 {
     int i, j;
-    double *data1;
     double temp, temp2;
 
-    data1 = malloc((len+16) * sizeof(double));
-    apply_welch_window(data, len, data1);
-    data1[len] = 0;
-
     for (i=0; i<=lag; ++i) {
         temp = 1.0;
         temp2 = 1.0;
@@ -66,17 +156,229 @@ compute_autocorr(const int32_t *data, int len, int lag, double *autoc)
         }
         autoc[i] = temp + temp2;
     }
+}
 
-    free(data1);
+/**
+ * zero padding in front of single-precision analysis data.  it covers the
+ * largest lag plus the extra lags of one pass of the AVX2 loop, and keeps
+ * the data 32-byte aligned.
+ */
+#define FLOAT_PAD (MAX_LPC_ORDER+8)
+
+/**
+ * Calculates autocorrelation data from single-precision windowed samples
+ * The data must be preceded by FLOAT_PAD zeros and zero-padded to a multiple
+ * of 8 samples.  Products and sums are in double precision: the product of
+ * two floats is exact in double, while rounding it to float changes the
+ * quantized coefficients in most frames of highly correlated audio.
+ */
+static void
+compute_autocorr_float(const float *data, int len, int lag, double *autoc)
+{
+    int i, j;
+    double temp, temp2;
+
+    for(i=0; i<=lag; i++) {
+        temp = 1.0;
+        temp2 = 1.0;
+        for(j=0; j<len; j+=2) {
+            temp  += (double)data[j]   * data[j-i];
+            temp2 += (double)data[j+1] * data[j+1-i];
+        }
+        autoc[i] = temp + temp2;
+    }
+}
+
+#ifdef HAVE_AVX2_INTRINSICS
+static inline __attribute__((target("avx2,fma"))) double
+hsum_avx(__m256d v)
+{
+    __m128d x = _mm_add_pd(_mm256_castpd256_pd128(v),
+                           _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(x, _mm_unpackhi_pd(x, x)));
+}
+
+/**
+ * AVX2 version of compute_autocorr_float()
+ * Four lags are computed per pass over the data, 8 samples at a time.
+ */
+static __attribute__((target("avx2,fma"))) void
+compute_autocorr_float_avx2(const float *data, int len, int lag,
+                            double *autoc)
+{
+    int i, j, k;
+    __m256d x0, x1, a0[4], a1[4];
+
+    for(i=0; i<=lag; i+=4) {
+        for(k=0; k<4; k++) {
+            a0[k] = _mm256_set1_pd(0.5);
+            a1[k] = _mm256_set1_pd(0.0);
+        }
+        for(j=0; j<len; j+=8) {
+            x0 = _mm256_cvtps_pd(_mm_load_ps(&data[j]));
+            x1 = _mm256_cvtps_pd(_mm_load_ps(&data[j+4]));
+            for(k=0; k<4; k++) {
+                const float *y = &data[j-i-k];
+                a0[k] = _mm256_fmadd_pd(x0, _mm256_cvtps_pd(_mm_loadu_ps(y)),
+                                        a0[k]);
+                a1[k] = _mm256_fmadd_pd(x1, _mm256_cvtps_pd(_mm_loadu_ps(y+4)),
+                                        a1[k]);
+            }
+        }
+        for(k=0; k<4 && i+k<=lag; k++)
+            autoc[i+k] = hsum_avx(_mm256_add_pd(a0[k], a1[k]));
+    }
+}
+#endif
+
+void
+lpc_init(LpcContext *lpc, MemContext *mem, int apodization, int tukey_p,
+         int float_analysis)
+{
+    int n = 0;
+
+    memset(lpc, 0, sizeof(LpcContext));
+    lpc->mem = mem;
+    lpc->tukey_p = tukey_p;
+    if(apodization & FLAKE_WINDOW_WELCH)
+        lpc->windows[n++] = WINDOW_WELCH;
+    if(apodization & FLAKE_WINDOW_HANN)
+        lpc->windows[n++] = WINDOW_HANN;
+    if(apodization & FLAKE_WINDOW_TUKEY)
+        lpc->windows[n++] = WINDOW_TUKEY;
+    if(apodization & FLAKE_WINDOW_PARTIAL_TUKEY) {
+        lpc->windows[n++] = WINDOW_PARTIAL_TUKEY_1;
+        lpc->windows[n++] = WINDOW_PARTIAL_TUKEY_2;
+    }
+    if(!n)
+        lpc->windows[n++] = WINDOW_WELCH;
+    lpc->window_count = n;
+
+    if(float_analysis) {
+        lpc->autocorr_float = compute_autocorr_float;
+#ifdef HAVE_AVX2_INTRINSICS
+        if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            lpc->autocorr_float = compute_autocorr_float_avx2;
+#endif
+    }
+}
+
+void
+lpc_close(LpcContext *lpc)
+{
+    int i;
+
+    for(i=0; i<LPC_WINDOW_CACHE_SIZE; i++) {
+        mem_free(lpc->mem, lpc->cache[i].data);
+        lpc->cache[i].data = NULL;
+        lpc->cache[i].size = 0;
+    }
+}
+
+int
+lpc_same_windows(const LpcContext *a, const LpcContext *b)
+{
+    int w;
+
+    if(a->window_count != b->window_count || a->tukey_p != b->tukey_p ||
+       a->autocorr_float != b->autocorr_float)
+        return 0;
+    for(w=0; w<a->window_count; w++) {
+        if(a->windows[w] != b->windows[w])
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Single-precision version of the windowing in lpc_calc_autocorr()
+ */
+static int
+calc_autocorr_float(LpcContext *lpc, const int32_t *samples, int blocksize,
+                    int max_order, const double **win, int nwin,
+                    double autoc[][MAX_LPC_ORDER+1])
+{
+    int i, w, len, stride;
+    float *data[LPC_MAX_WINDOWS];
+    float *buf;
+
+    len = (blocksize + 7) & ~7;
+    stride = FLOAT_PAD + len;
+    buf = mem_calloc(lpc->mem, nwin * stride + 8, sizeof(float));
+    if(!buf) return -1;
+    // align data to 32 bytes for the AVX2 loads
+    i = (8 - (((uintptr_t)buf >> 2) & 7)) & 7;
+    for(w=0; w<nwin; w++) {
+        data[w] = &buf[i + w * stride + FLOAT_PAD];
+    }
+    for(i=0; i<blocksize; i++) {
+        double x = samples[i];
+        for(w=0; w<nwin; w++) {
+            data[w][i] = (float)(x * win[w][i]);
+        }
+    }
+
+    for(w=0; w<nwin; w++) {
+        lpc->autocorr_float(data[w], len, max_order, autoc[w]);
+    }
+
+    mem_free(lpc->mem, buf);
+    return nwin;
+}
+
+/**
+ * Calculates autocorrelation data for each window in the context
+ * All windows are applied in a single pass over the samples.
+ */
+int
+lpc_calc_autocorr(LpcContext *lpc, const int32_t *samples, int blocksize,
+                  int max_order, double autoc[][MAX_LPC_ORDER+1])
+{
+    int i, w, nwin;
+    const double *win[LPC_MAX_WINDOWS];
+    double *data1[LPC_MAX_WINDOWS];
+    double *buf;
+
+    nwin = lpc->window_count;
+    for(w=0; w<nwin; w++) {
+        win[w] = get_window(lpc, lpc->windows[w], blocksize);
+        if(!win[w]) return -1;
+    }
+
+    if(lpc->autocorr_float) {
+        return calc_autocorr_float(lpc, samples, blocksize, max_order, win,
+                                   nwin, autoc);
+    }
+
+    buf = mem_alloc(lpc->mem, nwin * (blocksize+16) * sizeof(double));
+    if(!buf) return -1;
+    for(w=0; w<nwin; w++) {
+        data1[w] = &buf[w * (blocksize+16)];
+        data1[w][blocksize] = 0;
+    }
+    for(i=0; i<blocksize; i++) {
+        double x = samples[i];
+        for(w=0; w<nwin; w++) {
+            data1[w][i] = x * win[w][i];
+        }
+    }
+
+    for(w=0; w<nwin; w++) {
+        compute_autocorr(data1[w], blocksize, max_order, autoc[w]);
+    }
+
+    mem_free(lpc->mem, buf);
+    return nwin;
 }
 
 /**
  * Levinson-Durbin recursion.
- * Produces LPC coefficients from autocorrelation data.
+ * Produces LPC coefficients from autocorrelation data.  If err is not NULL,
+ * the prediction error for each order is stored in it.
  */
 static void
 compute_lpc_coefs(const double *autoc, int max_order, double *ref,
-                  double lpc[][MAX_LPC_ORDER])
+                  double lpc[][MAX_LPC_ORDER], double *err_out)
 {
     int i, j, i2;
     double r, err, tmp;
@@ -113,6 +415,9 @@ compute_lpc_coefs(const double *autoc, int max_order, double *ref,
         for(j=0; j<=i; j++) {
             lpc[i][j] = -lpc_tmp[j];
         }
+        if(err_out) {
+            err_out[i] = err;
+        }
     }
 }
 
@@ -156,7 +461,7 @@ compute_lpc_coefs_est(const double *autoc, int max_order,
     }
 
     // Levinson recursion
-    compute_lpc_coefs(NULL, order_est, ref, lpc);
+    compute_lpc_coefs(NULL, order_est, ref, lpc, NULL);
 
     return order_est;
 }
@@ -219,25 +524,23 @@ quantize_lpc_coefs(double *lpc_in, int order, int precision, int32_t *lpc_out,
 }
 
 /**
- * Calculate LPC coefficients for multiple orders
+ * Calculate LPC coefficients for multiple orders from autocorrelation data
+ * If err is not NULL, the Levinson prediction error for each order is also
+ * returned.  It is not computed for FLAKE_ORDER_METHOD_EST.
  */
 int
-lpc_calc_coefs(const int32_t *samples, int blocksize, int max_order,
-               int precision, int omethod, int32_t coefs[][MAX_LPC_ORDER],
-               int *shift)
+lpc_calc_coefs(const double *autoc, int max_order, int precision, int omethod,
+               int32_t coefs[][MAX_LPC_ORDER], int *shift, double *err)
 {
-    double autoc[MAX_LPC_ORDER+1];
     double lpc[MAX_LPC_ORDER][MAX_LPC_ORDER];
     int i;
     int opt_order;
 
-    compute_autocorr(samples, blocksize, max_order, autoc);
-
     opt_order = max_order;
     if(omethod == FLAKE_ORDER_METHOD_EST) {
         opt_order = compute_lpc_coefs_est(autoc, max_order, lpc);
     } else {
-        compute_lpc_coefs(autoc, max_order, NULL, lpc);
+        compute_lpc_coefs(autoc, max_order, NULL, lpc, err);
     }
 
     switch(omethod) {
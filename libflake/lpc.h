@@ -21,11 +21,60 @@
 #define LPC_H
 
 #include "common.h"
+#include "mem.h"
 
 #define MAX_LPC_ORDER 32
 
-extern int lpc_calc_coefs(const int32_t *samples, int blocksize, int max_order,
-                          int precision, int omethod,
-                          int32_t coefs[][MAX_LPC_ORDER], int *shift);
+/** maximum number of apodization windows used for one subframe */
+#define LPC_MAX_WINDOWS 5
+
+/** number of window functions kept in the cache */
+#define LPC_WINDOW_CACHE_SIZE 16
+
+typedef struct LpcWindow {
+    int type;
+    int len;
+    int size;
+    double *data;
+} LpcWindow;
+
+typedef struct LpcContext {
+    int windows[LPC_MAX_WINDOWS];
+    int window_count;
+    int tukey_p;
+    int next_slot;
+    LpcWindow cache[LPC_WINDOW_CACHE_SIZE];
+    void (*autocorr_float)(const float *data, int len, int lag,
+                           double *autoc);  ///< NULL for double analysis
+    MemContext *mem;
+} LpcContext;
+
+/**
+ * Set up the analysis windows from a mask of FlakeWindow flags
+ * tukey_p is the tapered percentage of Tukey windows.
+ * if float_analysis is set, windowed samples are stored in single precision
+ * and autocorrelation uses AVX2 when the CPU supports it.
+ */
+extern void lpc_init(LpcContext *lpc, MemContext *mem, int apodization,
+                     int tukey_p, int float_analysis);
+
+extern void lpc_close(LpcContext *lpc);
+
+/**
+ * Returns 1 if both contexts give the same autocorrelation data
+ */
+extern int lpc_same_windows(const LpcContext *a, const LpcContext *b);
+
+/**
+ * Calculate autocorrelation data for each analysis window
+ * Returns the number of windows, or -1 on error.
+ */
+extern int lpc_calc_autocorr(LpcContext *lpc, const int32_t *samples,
+                             int blocksize, int max_order,
+                             double autoc[][MAX_LPC_ORDER+1]);
+
+extern int lpc_calc_coefs(const double *autoc, int max_order, int precision,
+                          int omethod, int32_t coefs[][MAX_LPC_ORDER],
+                          int *shift, double *err);
 
 #endif /* LPC_H */
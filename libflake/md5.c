@@ -160,7 +160,7 @@ body(MD5Context *ctx, const void *data, uint32_t size)
 }
 
 void
-md5_init(MD5Context *ctx)
+md5_init(MD5Context *ctx, MemContext *mem)
 {
     ctx->a = 0x67452301;
     ctx->b = 0xefcdab89;
@@ -172,6 +172,18 @@ md5_init(MD5Context *ctx)
 
     ctx->data_buffer = NULL;
     ctx->data_buffer_size = 0;
+    ctx->mem = mem;
+}
+
+void
+md5_reset(MD5Context *ctx)
+{
+    uint8_t *data_buffer = ctx->data_buffer;
+    int data_buffer_size = ctx->data_buffer_size;
+
+    md5_init(ctx, ctx->mem);
+    ctx->data_buffer = data_buffer;
+    ctx->data_buffer_size = data_buffer_size;
 }
 
 void
@@ -179,8 +191,7 @@ md5_close(MD5Context *ctx)
 {
     uint8_t result[16];
     md5_final(result, ctx);
-    if (ctx->data_buffer)
-        free(ctx->data_buffer);
+    mem_free(ctx->mem, ctx->data_buffer);
     ctx->data_buffer = NULL;
     ctx->data_buffer_size = 0;
 }
@@ -278,6 +289,23 @@ md5_final(uint8_t *result, MD5Context *ctx)
 /**
  * Run md5_update on the audio signal byte stream
  */
+/**
+ * Make room for data_bytes of raw audio in the data buffer
+ */
+static int
+alloc_data_buffer(MD5Context *ctx, int data_bytes)
+{
+    if (ctx->data_buffer_size >= data_bytes)
+        return 0;
+    mem_free(ctx->mem, ctx->data_buffer);
+    ctx->data_buffer_size = 0;
+    ctx->data_buffer = mem_alloc(ctx->mem, data_bytes);
+    if (!ctx->data_buffer)
+        return -1;
+    ctx->data_buffer_size = data_bytes;
+    return 0;
+}
+
 void
 md5_accumulate(MD5Context *ctx, const int32_t *signal, int ch, int bps,
                int nsamples)
@@ -295,14 +323,8 @@ md5_accumulate(MD5Context *ctx, const int32_t *signal, int ch, int bps,
     bytes_per_sample = (bps + 7) >> 3;
     data_bytes = ch * nsamples * bytes_per_sample;
 
-    /* allocate data buffer, if needed */
-    if (ctx->data_buffer_size < data_bytes) {
-        ctx->data_buffer_size = 0;
-        ctx->data_buffer = realloc(ctx->data_buffer, data_bytes);
-        if (!ctx->data_buffer)
-            return;
-        ctx->data_buffer_size = data_bytes;
-    }
+    if (alloc_data_buffer(ctx, data_bytes))
+        return;
 
     /* convert sample values to little-endian raw audio data */
     k = 0;
@@ -319,6 +341,67 @@ md5_accumulate(MD5Context *ctx, const int32_t *signal, int ch, int bps,
     md5_update(ctx, ctx->data_buffer, data_bytes);
 }
 
+/**
+ * Run md5_update on the audio signal byte stream.  The bytes are written in
+ * channel-interleaved order straight from the channel buffers.
+ */
+void
+md5_accumulate_planar(MD5Context *ctx, const int32_t *const *signal, int ch,
+                      int bps, int nsamples)
+{
+    int i, c, k;
+    int bytes_per_sample, data_bytes;
+
+    assert(ch > 0 && ch <= 8);
+    assert(bps > 0 && bps <= 32);
+    assert(nsamples >= 0);
+
+    if (!nsamples)
+        return;
+
+    bytes_per_sample = (bps + 7) >> 3;
+    data_bytes = ch * nsamples * bytes_per_sample;
+
+    if (alloc_data_buffer(ctx, data_bytes))
+        return;
+
+    /* convert sample values to little-endian raw audio data */
+    for (c = 0; c < ch; c++) {
+        const int32_t *s = signal[c];
+        uint8_t *p = &ctx->data_buffer[c * bytes_per_sample];
+        int stride = ch * bytes_per_sample;
+        for (i = 0; i < nsamples; i++, p += stride) {
+            int32_t x = le2me_32(s[i]);
+            for (k = 0; k < bytes_per_sample; k++) {
+                p[k] = x & 0xFF;
+                x >>= 8;
+            }
+        }
+    }
+
+    md5_update(ctx, ctx->data_buffer, data_bytes);
+}
+
+void
+md5_accumulate_s16(MD5Context *ctx, const int16_t *signal, int nvalues)
+{
+#ifdef WORDS_BIGENDIAN
+    int i;
+    int data_bytes = nvalues * 2;
+
+    if (alloc_data_buffer(ctx, data_bytes))
+        return;
+    for (i = 0; i < nvalues; i++) {
+        ctx->data_buffer[2*i]   = signal[i] & 0xFF;
+        ctx->data_buffer[2*i+1] = (signal[i] >> 8) & 0xFF;
+    }
+    md5_update(ctx, ctx->data_buffer, data_bytes);
+#else
+    // the samples are already the bytes to hash
+    md5_update(ctx, signal, nvalues * 2);
+#endif
+}
+
 void
 md5_print(uint8_t digest[16])
 {
@@ -13,6 +13,7 @@
 #define MD5_H
 
 #include "common.h"
+#include "mem.h"
 
 typedef struct {
     uint32_t lo, hi;
@@ -21,9 +22,15 @@ typedef struct {
     uint32_t block[16];
     uint8_t *data_buffer;
     int data_buffer_size;
+    MemContext *mem;
 } MD5Context;
 
-extern void md5_init(MD5Context *ctx);
+extern void md5_init(MD5Context *ctx, MemContext *mem);
+
+/**
+ * Restart the checksum, keeping the conversion buffer
+ */
+extern void md5_reset(MD5Context *ctx);
 
 extern void md5_close(MD5Context *ctx);
 
@@ -34,6 +41,19 @@ extern void md5_final(uint8_t *result, MD5Context *ctx);
 extern void md5_accumulate(MD5Context *ctx, const int32_t *signal, int ch,
                            int bps, int nsamples);
 
+/**
+ * Same as md5_accumulate, for one signal buffer per channel
+ */
+extern void md5_accumulate_planar(MD5Context *ctx,
+                                  const int32_t *const *signal, int ch,
+                                  int bps, int nsamples);
+
+/**
+ * Run md5_update on 16-bit samples, in little-endian byte order
+ */
+extern void md5_accumulate_s16(MD5Context *ctx, const int16_t *signal,
+                               int nvalues);
+
 extern void md5_print(uint8_t digest[16]);
 
 #endif /* MD5_H */
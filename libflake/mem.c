@@ -0,0 +1,97 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * Flake is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Flake is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Flake; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include "common.h"
+
+#include "mem.h"
+
+/**
+ * Each block starts with its size, which keeps the count without asking the
+ * allocator, and is padded to keep the alignment of the block.
+ */
+#define MEM_HEADER_SIZE 16
+
+static void *
+default_alloc(void *opaque, size_t size)
+{
+    (void)opaque;
+    return malloc(size);
+}
+
+static void
+default_free(void *opaque, void *ptr)
+{
+    (void)opaque;
+    free(ptr);
+}
+
+void
+mem_init(MemContext *mem, const FlakeAllocator *allocator)
+{
+    memset(mem, 0, sizeof(MemContext));
+    if(allocator && allocator->alloc && allocator->free) {
+        mem->allocator = *allocator;
+    } else {
+        mem->allocator.alloc = default_alloc;
+        mem->allocator.free = default_free;
+    }
+}
+
+void *
+mem_alloc(MemContext *mem, size_t size)
+{
+    uint8_t *block;
+
+    if(size > SIZE_MAX - MEM_HEADER_SIZE)
+        return NULL;
+    size += MEM_HEADER_SIZE;
+    block = mem->allocator.alloc(mem->allocator.opaque, size);
+    if(!block)
+        return NULL;
+    *(size_t *)block = size;
+    mem->current += size;
+    mem->peak = MAX(mem->peak, mem->current);
+    return block + MEM_HEADER_SIZE;
+}
+
+void *
+mem_calloc(MemContext *mem, size_t n, size_t size)
+{
+    void *ptr;
+
+    if(size && n > SIZE_MAX / size)
+        return NULL;
+    ptr = mem_alloc(mem, n * size);
+    if(ptr)
+        memset(ptr, 0, n * size);
+    return ptr;
+}
+
+void
+mem_free(MemContext *mem, void *ptr)
+{
+    uint8_t *block;
+
+    if(!ptr)
+        return;
+    block = (uint8_t *)ptr - MEM_HEADER_SIZE;
+    mem->current -= *(size_t *)block;
+    mem->allocator.free(mem->allocator.opaque, block);
+}
@@ -0,0 +1,56 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * Flake is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Flake is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Flake; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef MEM_H
+#define MEM_H
+
+#include "common.h"
+#include "flake.h"
+
+/**
+ * Allocations of one encoder, counted in bytes requested from the allocator
+ */
+typedef struct MemContext {
+    FlakeAllocator allocator;
+    size_t current;
+    size_t peak;
+} MemContext;
+
+/**
+ * Use the given allocator, or malloc and free if it is NULL
+ */
+extern void mem_init(MemContext *mem, const FlakeAllocator *allocator);
+
+/**
+ * Allocate a block aligned to 16 bytes, or return NULL
+ */
+extern void *mem_alloc(MemContext *mem, size_t size);
+
+/**
+ * Allocate a zeroed block for n elements, or return NULL
+ */
+extern void *mem_calloc(MemContext *mem, size_t n, size_t size);
+
+/**
+ * Free a block, which can be NULL
+ */
+extern void mem_free(MemContext *mem, void *ptr);
+
+#endif /* MEM_H */
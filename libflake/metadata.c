@@ -57,9 +57,13 @@ flake_get_streaminfo(const FlakeContext *s, FlakeStreaminfo *strminfo)
     strminfo->bits_per_sample   = ctx->bps;
     strminfo->samples           = ctx->sample_count;
 
-    // get MD5 checksum
-    md5_bak = ctx->md5ctx;
-    md5_final(strminfo->md5sum, &md5_bak);
+    // get MD5 checksum, which an output takes from its driver
+    if(ctx->have_md5sum) {
+        memcpy(strminfo->md5sum, ctx->md5sum, 16);
+    } else {
+        md5_bak = ctx->driver ? ctx->driver->md5ctx : ctx->md5ctx;
+        md5_final(strminfo->md5sum, &md5_bak);
+    }
 
     return 0;
 }
@@ -77,8 +81,14 @@ flake_write_streaminfo(const FlakeStreaminfo *strminfo, uint8_t *data)
     bitwriter_writebits(&bw, 20, strminfo->sample_rate);
     bitwriter_writebits(&bw,  3, strminfo->channels-1);
     bitwriter_writebits(&bw,  5, strminfo->bits_per_sample-1);
-    bitwriter_writebits(&bw,  4, 0);
-    bitwriter_writebits(&bw, 32, strminfo->samples);
+    if(strminfo->samples >> 36) {
+        // too long to store, so the length is unknown
+        bitwriter_writebits(&bw,  4, 0);
+        bitwriter_writebits(&bw, 32, 0);
+    } else {
+        bitwriter_writebits(&bw,  4, (uint32_t)(strminfo->samples >> 32));
+        bitwriter_writebits(&bw, 32, (uint32_t)strminfo->samples);
+    }
     bitwriter_flush(&bw);
     memcpy(&data[18], strminfo->md5sum, 16);
 }
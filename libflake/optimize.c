@@ -25,6 +25,12 @@
 #include "lpc.h"
 #include "rice.h"
 
+/** number of orders fully evaluated by FLAKE_ORDER_METHOD_MODEL */
+#define MODEL_ORDER_CANDIDATES 4
+
+/** order of the residual fit used by the fixed-prediction screen */
+#define SCREEN_LPC_ORDER 4
+
 static void
 encode_residual_verbatim(int32_t *res, int32_t *smp, int n)
 {
@@ -67,17 +73,18 @@ encode_residual_fixed(int32_t *res, int32_t *smp, int n, int order)
     }
 }
 
+/**
+ * Calculate LPC residual for samples start to end-1.  start must be at least
+ * the prediction order.
+ */
 static void
-encode_residual_lpc(int32_t *res, int32_t *smp, int n, int order,
-                    int32_t *coefs, int shift)
+encode_residual_lpc_range(int32_t *res, int32_t *smp, int start, int end,
+                          int order, int32_t *coefs, int shift)
 {
     int i;
     int64_t pred;
 
-    for(i=0; i<order; i++) {
-        res[i] = smp[i];
-    }
-    for(i=order; i<n; i++) {
+    for(i=start; i<end; i++) {
         pred = 0;
         // note that all cases fall through.
         // the result is in an unrolled loop for each order
@@ -121,6 +128,380 @@ encode_residual_lpc(int32_t *res, int32_t *smp, int n, int order,
     }
 }
 
+static void
+encode_residual_lpc(int32_t *res, int32_t *smp, int n, int order,
+                    int32_t *coefs, int shift)
+{
+    int i;
+
+    for(i=0; i<order; i++) {
+        res[i] = smp[i];
+    }
+    encode_residual_lpc_range(res, smp, order, n, order, coefs, shift);
+}
+
+/**
+ * Calculate LPC residual and its bit count one partition at a time, giving up
+ * as soon as a lower bound on the bit count reaches max_bits.
+ * Returns the same bit count as calc_rice_params_lpc(), or a value of at least
+ * max_bits if the order was abandoned.
+ */
+static uint32_t
+encode_residual_lpc_bounded(FlacEncodeContext *ctx, int ch, int order,
+                            int32_t *coefs, int shift, uint32_t max_bits)
+{
+    int i, n, psize, start, end;
+    int64_t bound;
+    FlacSubframe *sub;
+    RiceBound rb;
+
+    sub = &ctx->frame.subframes[ch];
+    n = ctx->frame.blocksize;
+
+    rice_bound_init_lpc(&rb, ctx->params.min_partition_order,
+                        ctx->params.max_partition_order, n, order, sub->obits,
+                        ctx->lpc_precision);
+    psize = n >> rb.pmax;
+
+    for(i=0; i<order; i++) {
+        sub->residual[i] = sub->samples[i];
+    }
+    start = order;
+    for(i=0; i<(1 << rb.pmax); i++) {
+        end = (i+1) * psize;
+        encode_residual_lpc_range(sub->residual, sub->samples, start, end,
+                                  order, coefs, shift);
+        bound = rice_bound_add_partition(&rb, &sub->residual[start],
+                                         end-start);
+        if(bound >= max_bits)
+            return (uint32_t)MIN(bound, UINT32_MAX);
+        start = end;
+    }
+    return rice_bound_finish(&rb, &sub->rc);
+}
+
+/**
+ * Fixed-predictor screen for FlakeEncodeParams.fixed_screen.
+ * The best fixed order is chosen from residual magnitudes and its residual is
+ * left in the subframe.  The gain that LPC could still add is estimated from a
+ * low-order Levinson fit to that residual.  Returns 1 if the gain is below the
+ * screen threshold and LPC analysis should be skipped, or 0 otherwise.
+ */
+static int
+screen_fixed(FlacEncodeContext *ctx, int ch, int *fixed_order,
+             uint32_t *fixed_bits)
+{
+    int i, j, k, order;
+    int n;
+    FlacSubframe *sub;
+    int32_t *res, *smp;
+    uint64_t err[5];
+    int64_t e0, e1, e2, e3, e4, last0, last1, last2, last3;
+    double autoc[SCREEN_LPC_ORDER+1];
+    double lpc[SCREEN_LPC_ORDER];
+    double r, perr, gain;
+    double inv_ln2 = 1.0 / log(2.0);
+
+    sub = &ctx->frame.subframes[ch];
+    res = sub->residual;
+    smp = sub->samples;
+    n = ctx->frame.blocksize;
+
+    // residual magnitudes for all fixed orders in one pass
+    last0 = smp[3];
+    last1 = smp[3] - smp[2];
+    last2 = last1 - (smp[2] - smp[1]);
+    last3 = last2 - ((smp[2] - smp[1]) - (smp[1] - smp[0]));
+    memset(err, 0, sizeof(err));
+    for(i=4; i<n; i++) {
+        e0 = smp[i];
+        e1 = e0 - last0;
+        e2 = e1 - last1;
+        e3 = e2 - last2;
+        e4 = e3 - last3;
+        err[0] += (e0 < 0) ? -e0 : e0;
+        err[1] += (e1 < 0) ? -e1 : e1;
+        err[2] += (e2 < 0) ? -e2 : e2;
+        err[3] += (e3 < 0) ? -e3 : e3;
+        err[4] += (e4 < 0) ? -e4 : e4;
+        last0 = e0;
+        last1 = e1;
+        last2 = e2;
+        last3 = e3;
+    }
+    order = 0;
+    for(i=1; i<5; i++) {
+        if(err[i] < err[order]) order = i;
+    }
+
+    *fixed_order = order;
+    encode_residual_fixed(res, smp, n, order);
+    *fixed_bits = calc_rice_params_fixed(&sub->rc,
+                                         ctx->params.min_partition_order,
+                                         ctx->params.max_partition_order,
+                                         res, n, order, sub->obits);
+
+    // bits saved by a Levinson fit to the fixed residual, less the cost of
+    // its coefficients, at the order that saves the most
+    for(j=0; j<=SCREEN_LPC_ORDER; j++) {
+        autoc[j] = 0.0;
+        for(i=order+SCREEN_LPC_ORDER; i<n; i++) {
+            autoc[j] += (double)res[i] * res[i-j];
+        }
+    }
+    if(autoc[0] <= 0.0) {
+        return 1;
+    }
+    perr = autoc[0];
+    gain = 0.0;
+    for(j=0; j<SCREEN_LPC_ORDER; j++) {
+        r = autoc[j+1];
+        for(k=0; k<j; k++) {
+            r -= lpc[k] * autoc[j-k];
+        }
+        r /= perr;
+        for(k=0; k<(j >> 1); k++) {
+            double tmp = lpc[k];
+            lpc[k] -= r * lpc[j-1-k];
+            lpc[j-1-k] -= r * tmp;
+        }
+        if(j & 1) {
+            lpc[k] -= r * lpc[k];
+        }
+        lpc[j] = r;
+        perr *= 1.0 - (r * r);
+        if(perr <= 0.0) {
+            return 0;
+        }
+        gain = MAX(gain, 0.5 * (n - order) * log(autoc[0] / perr) * inv_ln2 -
+                         (j + 1) * (ctx->lpc_precision + (sub->obits >> 1)));
+    }
+
+    // fixed_screen is in tenths of a percent of the fixed subframe size
+    return gain * 1000.0 < (double)ctx->params.fixed_screen * *fixed_bits;
+}
+
+/**
+ * Estimate the size of an LPC subframe for each order from the Levinson
+ * prediction error, and return the indices of the orders with the smallest
+ * estimates, best first.
+ */
+static int
+model_order_candidates(const double *err, int min_order, int max_order, int n,
+                       int obits, int precision, int *cand)
+{
+    int i, j, k, ncand;
+    double est[MAX_LPC_ORDER];
+    double inv_ln2 = 1.0 / log(2.0);
+
+    if(min_order < 1) min_order = 1;
+    for(i=min_order-1; i<max_order; i++) {
+        // residual bits per sample change with log2 of the error's std dev.
+        // each order adds a coefficient and replaces a residual sample with
+        // a warmup sample, which costs about half of obits more.
+        double e = MAX(err[i], 1.0);
+        est[i] = 0.5 * n * log(e) * inv_ln2 +
+                 (i + 1) * (precision + (obits >> 1));
+    }
+
+    cand[0] = max_order-1;
+    ncand = 0;
+    for(i=min_order-1; i<max_order; i++) {
+        // insertion into a short sorted list; ties favor the lower order
+        for(j=ncand; j>0 && est[i] < est[cand[j-1]]; j--);
+        if(j >= MODEL_ORDER_CANDIDATES)
+            continue;
+        k = MIN(ncand, MODEL_ORDER_CANDIDATES-1);
+        for(; k>j; k--) cand[k] = cand[k-1];
+        cand[j] = i;
+        if(ncand < MODEL_ORDER_CANDIDATES) ncand++;
+    }
+    return ncand;
+}
+
+/**
+ * Choose the LPC prediction order for one set of quantized coefficients.
+ * Returns the order, or -1 on error.  The subframe size for that order is
+ * returned in opt_bits, or UINT32_MAX if the order method did not measure it.
+ */
+static int
+select_lpc_order(FlacEncodeContext *ctx, int ch,
+                 int32_t coefs[][MAX_LPC_ORDER], int *shift, int est_order,
+                 const double *lpc_err, uint32_t *opt_bits)
+{
+    int i, n, omethod, min_order, max_order, opt_order;
+    FlacSubframe *sub;
+
+    sub = &ctx->frame.subframes[ch];
+    n = ctx->frame.blocksize;
+    omethod = ctx->params.order_method;
+    min_order = ctx->params.min_prediction_order;
+    max_order = ctx->params.max_prediction_order;
+    *opt_bits = UINT32_MAX;
+
+    if(omethod == FLAKE_ORDER_METHOD_MAX) {
+        // always use maximum order
+        opt_order = max_order;
+    } else if(omethod == FLAKE_ORDER_METHOD_EST) {
+        // estimated order
+        opt_order = est_order;
+    } else if(omethod == FLAKE_ORDER_METHOD_2LEVEL ||
+              omethod == FLAKE_ORDER_METHOD_4LEVEL ||
+              omethod == FLAKE_ORDER_METHOD_8LEVEL) {
+        int levels = 1 << (omethod-1);
+        uint32_t bits[8];
+        int order;
+        int opt_index = levels-1;
+        opt_order = max_order-1;
+        bits[opt_index] = UINT32_MAX;
+        for(i=opt_index; i>=0; i--) {
+            order = min_order + (((max_order-min_order+1) * (i+1)) / levels)-2;
+            if(order < 0) order = 0;
+            bits[i] = encode_residual_lpc_bounded(ctx, ch, order+1,
+                                                  coefs[order], shift[order],
+                                                  bits[opt_index]);
+            if(bits[i] < bits[opt_index]) {
+                opt_index = i;
+                opt_order = order;
+            }
+        }
+        *opt_bits = bits[opt_index];
+        opt_order++;
+    } else if(omethod == FLAKE_ORDER_METHOD_SEARCH) {
+        // brute-force optimal order search
+        // the maximum order is tried first since it is usually close to the
+        // best, which lets the other orders be abandoned early.  on a tie,
+        // the lowest order is chosen.
+        uint32_t bits[MAX_LPC_ORDER];
+        opt_order = max_order-1;
+        bits[opt_order] = encode_residual_lpc_bounded(ctx, ch, max_order,
+                                                      coefs[opt_order],
+                                                      shift[opt_order],
+                                                      UINT32_MAX);
+        for(i=0; i<max_order-1; i++) {
+            bits[i] = encode_residual_lpc_bounded(ctx, ch, i+1, coefs[i],
+                                                  shift[i],
+                                                  bits[opt_order] + (i < opt_order));
+            if(bits[i] < bits[opt_order] ||
+               (bits[i] == bits[opt_order] && i < opt_order)) {
+                opt_order = i;
+            }
+        }
+        *opt_bits = bits[opt_order];
+        opt_order++;
+    } else if(omethod == FLAKE_ORDER_METHOD_LOG) {
+        // log search (written by Michael Niedermayer for FFmpeg)
+        uint32_t bits[MAX_LPC_ORDER];
+        int step, seed, src;
+
+        opt_order = min_order - 1 + (max_order-min_order)/3;
+        step = 16;
+        memset(bits, -1, sizeof(bits));
+
+        // adjacent frames usually choose similar orders, so start with a
+        // narrow search around the previous order for this signal.  if the
+        // cost per sample jumped by more than 1/8, the signal has changed,
+        // so do the full search instead.
+        src = channel_source(ctx->frame.ch_mode, ch);
+        seed = ctx->last.order[src] - 1;
+        if(seed >= min_order-1 && seed < max_order) {
+            bits[seed] = encode_residual_lpc_bounded(ctx, ch, seed+1,
+                                                     coefs[seed], shift[seed],
+                                                     UINT32_MAX);
+            if((uint64_t)bits[seed] * ctx->last.blocksize[src] * 8 <=
+               (uint64_t)ctx->last.bits[src] * n * 9) {
+                opt_order = seed;
+                step = 4;
+            }
+        } else {
+            seed = -1;
+        }
+
+        for(; step>0; step>>=1){
+            int last = opt_order;
+            for(i=last-step; i<=last+step; i+= step){
+                if(i<min_order-1 || i>=max_order || bits[i] < UINT32_MAX)
+                    continue;
+                bits[i] = encode_residual_lpc_bounded(ctx, ch, i+1, coefs[i],
+                                                      shift[i],
+                                                      bits[opt_order]);
+                if(bits[i] < bits[opt_order]) {
+                    opt_order = i;
+                }
+            }
+        }
+        if(seed >= 0 && bits[seed] < bits[opt_order]) {
+            opt_order = seed;
+        }
+        *opt_bits = bits[opt_order];
+        opt_order++;
+    } else if(omethod == FLAKE_ORDER_METHOD_MODEL) {
+        // rank orders by estimated size, then search only the best few
+        uint32_t bits[MAX_LPC_ORDER];
+        int cand[MODEL_ORDER_CANDIDATES];
+        int ncand;
+
+        ncand = model_order_candidates(lpc_err, min_order, max_order, n,
+                                       sub->obits, ctx->lpc_precision, cand);
+        opt_order = cand[0];
+        bits[opt_order] = encode_residual_lpc_bounded(ctx, ch, opt_order+1,
+                                                      coefs[opt_order],
+                                                      shift[opt_order],
+                                                      UINT32_MAX);
+        for(i=1; i<ncand; i++) {
+            int order = cand[i];
+            bits[order] = encode_residual_lpc_bounded(ctx, ch, order+1,
+                                                      coefs[order],
+                                                      shift[order],
+                                                      bits[opt_order] + (order < opt_order));
+            if(bits[order] < bits[opt_order] ||
+               (bits[order] == bits[opt_order] && order < opt_order)) {
+                opt_order = order;
+            }
+        }
+        *opt_bits = bits[opt_order];
+        opt_order++;
+    } else {
+        return -1;
+    }
+
+
+    return opt_order;
+}
+
+/**
+ * Calculate the autocorrelation of a subframe, or take it from the shared
+ * frame analysis if another output has done so with the same windows and
+ * maximum order.  The summation order depends on the maximum order, so a
+ * larger one cannot be reused without changing the result.
+ */
+static int
+calc_autocorr(FlacEncodeContext *ctx, int src, const int32_t *smp, int n,
+              int max_order, double autoc[][MAX_LPC_ORDER+1])
+{
+    int nwin;
+    SharedFrame *sf;
+
+    sf = ctx->shared;
+    if(!sf)
+        return lpc_calc_autocorr(&ctx->lpc, smp, n, max_order, autoc);
+
+    if(sf->autoc_order[src] == max_order &&
+       lpc_same_windows(sf->autoc_lpc[src], &ctx->lpc)) {
+        nwin = sf->autoc_nwin[src];
+        memcpy(autoc, sf->autoc[src], nwin * sizeof(autoc[0]));
+        return nwin;
+    }
+    nwin = lpc_calc_autocorr(&ctx->lpc, smp, n, max_order, autoc);
+    if(nwin > 0) {
+        sf->autoc_order[src] = max_order;
+        sf->autoc_nwin[src] = nwin;
+        sf->autoc_lpc[src] = &ctx->lpc;
+        memcpy(sf->autoc[src], autoc, nwin * sizeof(autoc[0]));
+    }
+    return nwin;
+}
+
 int
 encode_residual(FlacEncodeContext *ctx, int ch)
 {
@@ -133,6 +514,12 @@ encode_residual(FlacEncodeContext *ctx, int ch)
     int min_order;
     int32_t *res, *smp;
     int est_order, omethod;
+    double lpc_err[MAX_LPC_ORDER];
+    double autoc[LPC_MAX_WINDOWS][MAX_LPC_ORDER+1];
+    uint32_t sub_bits, fixed_bits, lpc_bits;
+    int fixed_order;
+    int w, nwin, src;
+    const FrameHint *hint;
 
     frame = &ctx->frame;
     sub = &frame->subframes[ch];
@@ -189,90 +576,94 @@ encode_residual(FlacEncodeContext *ctx, int ch)
         return bits[sub->order];
     }
 
+    // FIXED screen before LPC analysis
+    fixed_order = -1;
+    fixed_bits = UINT32_MAX;
+    if(ctx->params.fixed_screen > 0) {
+        if(screen_fixed(ctx, ch, &fixed_order, &fixed_bits)) {
+            sub->order = fixed_order;
+            sub->type = FLAC_SUBFRAME_FIXED;
+            sub->type_code = sub->type | sub->order;
+            return fixed_bits;
+        }
+    }
+
     // LPC
-    est_order = lpc_calc_coefs(smp, n, max_order, ctx->lpc_precision,
-                               omethod, coefs, shift);
+    src = channel_source(frame->ch_mode, ch);
+    nwin = calc_autocorr(ctx, src, smp, n, max_order, autoc);
+    if(nwin < 0) {
+        return -1;
+    }
 
-    if(omethod == FLAKE_ORDER_METHOD_MAX) {
-        // always use maximum order
-        opt_order = max_order;
-    } else if(omethod == FLAKE_ORDER_METHOD_EST) {
-        // estimated order
-        opt_order = est_order;
-    } else if(omethod == FLAKE_ORDER_METHOD_2LEVEL ||
-              omethod == FLAKE_ORDER_METHOD_4LEVEL ||
-              omethod == FLAKE_ORDER_METHOD_8LEVEL) {
-        int levels = 1 << (omethod-1);
-        uint32_t bits[8];
-        int order;
-        int opt_index = levels-1;
-        opt_order = max_order-1;
-        bits[opt_index] = UINT32_MAX;
-        for(i=opt_index; i>=0; i--) {
-            order = min_order + (((max_order-min_order+1) * (i+1)) / levels)-2;
-            if(order < 0) order = 0;
-            encode_residual_lpc(res, smp, n, order+1, coefs[order], shift[order]);
-            bits[i] = calc_rice_params_lpc(&sub->rc, min_porder, max_porder,
-                                           res, n, order+1, sub->obits,
-                                           ctx->lpc_precision);
-            if(bits[i] < bits[opt_index]) {
-                opt_index = i;
-                opt_order = order;
-            }
+    // with several windows, keep the coefficients giving the smallest size
+    lpc_bits = UINT32_MAX;
+    for(w=0; w<nwin; w++) {
+        est_order = lpc_calc_coefs(autoc[w], max_order, ctx->lpc_precision,
+                                   omethod, coefs, shift, lpc_err);
+        opt_order = select_lpc_order(ctx, ch, coefs, shift, est_order,
+                                     lpc_err, &sub_bits);
+        if(opt_order < 0) {
+            return -1;
         }
-        opt_order++;
-    } else if(omethod == FLAKE_ORDER_METHOD_SEARCH) {
-        // brute-force optimal order search
-        uint32_t bits[MAX_LPC_ORDER];
-        opt_order = 0;
-        bits[0] = UINT32_MAX;
-        for(i=0; i<max_order; i++) {
-            encode_residual_lpc(res, smp, n, i+1, coefs[i], shift[i]);
-            bits[i] = calc_rice_params_lpc(&sub->rc, min_porder, max_porder,
-                                           res, n, i+1, sub->obits,
-                                           ctx->lpc_precision);
-            if(bits[i] < bits[opt_order]) {
-                opt_order = i;
+        if(nwin > 1 && sub_bits == UINT32_MAX) {
+            sub_bits = encode_residual_lpc_bounded(ctx, ch, opt_order,
+                                                   coefs[opt_order-1],
+                                                   shift[opt_order-1],
+                                                   lpc_bits);
+        }
+        if(w == 0 || sub_bits < lpc_bits) {
+            lpc_bits = sub_bits;
+            sub->order = opt_order;
+            sub->shift = shift[opt_order-1];
+            for(i=0; i<opt_order; i++) {
+                sub->coefs[i] = coefs[opt_order-1][i];
             }
         }
-        opt_order++;
-    } else if(omethod == FLAKE_ORDER_METHOD_LOG) {
-        // log search (written by Michael Niedermayer for FFmpeg)
-        uint32_t bits[MAX_LPC_ORDER];
-        int step;
-
-        opt_order = min_order - 1 + (max_order-min_order)/3;
-        memset(bits, -1, sizeof(bits));
+    }
 
-        for(step=16; step>0; step>>=1){
-            int last = opt_order;
-            for(i=last-step; i<=last+step; i+= step){
-                if(i<min_order-1 || i>=max_order || bits[i] < UINT32_MAX)
-                    continue;
-                encode_residual_lpc(res, smp, n, i+1, coefs[i], shift[i]);
-                bits[i] = calc_rice_params_lpc(&sub->rc, min_porder, max_porder,
-                                               res, n, i+1, sub->obits,
-                                               ctx->lpc_precision);
-                if(bits[i] < bits[opt_order]) {
-                    opt_order = i;
-                }
-            }
+    // in the VBS search, the coefficients of the enclosing block are also
+    // tried.  they are kept only if they code this block in fewer bits.
+    hint = ctx->hint;
+    if(hint && hint->order[src] >= min_order && hint->order[src] <= max_order) {
+        if(lpc_bits == UINT32_MAX) {
+            lpc_bits = encode_residual_lpc_bounded(ctx, ch, sub->order,
+                                                   sub->coefs, sub->shift,
+                                                   UINT32_MAX);
+        }
+        memcpy(coefs[0], hint->coefs[src], hint->order[src] * sizeof(int32_t));
+        sub_bits = encode_residual_lpc_bounded(ctx, ch, hint->order[src],
+                                               coefs[0], hint->shift[src],
+                                               lpc_bits);
+        if(sub_bits < lpc_bits) {
+            lpc_bits = sub_bits;
+            sub->order = hint->order[src];
+            sub->shift = hint->shift[src];
+            memcpy(sub->coefs, coefs[0], sub->order * sizeof(int32_t));
         }
-        opt_order++;
-    } else {
-        return -1;
     }
 
-    sub->order = opt_order;
     sub->type = FLAC_SUBFRAME_LPC;
     sub->type_code = sub->type | (sub->order-1);
-    sub->shift = shift[sub->order-1];
-    for(i=0; i<sub->order; i++) {
-        sub->coefs[i] = coefs[sub->order-1][i];
-    }
     encode_residual_lpc(res, smp, n, sub->order, sub->coefs, sub->shift);
-    return calc_rice_params_lpc(&sub->rc, min_porder, max_porder, res, n,
-                                sub->order, sub->obits, ctx->lpc_precision);
+    sub_bits = calc_rice_params_lpc(&sub->rc, min_porder, max_porder, res, n,
+                                    sub->order, sub->obits,
+                                    ctx->lpc_precision);
+
+    ctx->last.order[src] = sub->order;
+    ctx->last.blocksize[src] = n;
+    ctx->last.bits[src] = sub_bits;
+
+    // the screened fixed predictor can still be smaller than LPC
+    if(fixed_order >= 0 && fixed_bits < sub_bits) {
+        sub->order = fixed_order;
+        sub->type = FLAC_SUBFRAME_FIXED;
+        sub->type_code = sub->type | sub->order;
+        encode_residual_fixed(res, smp, n, sub->order);
+        return calc_rice_params_fixed(&sub->rc, min_porder, max_porder, res, n,
+                                      sub->order, sub->obits);
+    }
+
+    return sub_bits;
 }
 
 void
@@ -27,8 +27,13 @@
 #include "encode.h"
 #include "rice.h"
 
-int
-find_optimal_rice_param(uint64_t sum, int n)
+/**
+ * Exhaustive Rice parameter search.
+ * Used as a fallback when the bit count for a partition might not fit in 32
+ * bits, since the closed-form search cannot reproduce the wrapped results.
+ */
+static int
+find_optimal_rice_param_full(uint64_t sum, int n)
 {
     int k, k_opt;
     uint32_t nbits[MAX_RICE_PARAM+1];
@@ -44,6 +49,36 @@ find_optimal_rice_param(uint64_t sum, int n)
     return k_opt;
 }
 
+/**
+ * Find the Rice parameter which gives the lowest bit count for a partition.
+ * The bit count is convex in k, and the first minimum is the smallest k for
+ * which ((sum - n/2) >> k) <= 2*n.  An estimate of that k is calculated from
+ * the magnitudes of both sides, then refined by +/-1.  This gives the same
+ * result as testing every value of k.
+ */
+int
+find_optimal_rice_param(uint64_t sum, int n)
+{
+    int k;
+    uint64_t d, lim;
+
+    if(sum <= (uint64_t)(n >> 1))
+        return 0;
+    d = sum - (n >> 1);
+    if(d > UINT32_MAX - n)
+        return find_optimal_rice_param_full(sum, n);
+
+    lim = 2 * (uint64_t)n;
+    if(d <= lim)
+        return 0;
+    k = log2i((uint32_t)d) - log2i((uint32_t)lim);
+    while(k > 0 && (d >> (k-1)) <= lim)
+        k--;
+    while((d >> k) > lim)
+        k++;
+    return MIN(k, MAX_RICE_PARAM);
+}
+
 static uint32_t
 calc_optimal_rice_params(RiceContext *rc, int porder, uint64_t *sums,
                          int n, int pred_order)
@@ -73,13 +108,33 @@ calc_optimal_rice_params(RiceContext *rc, int porder, uint64_t *sums,
     return all_bits;
 }
 
+/**
+ * Calculate partition sums for lower partition orders from those of the
+ * highest partition order
+ */
 static void
-calc_sums(int pmin, int pmax, uint32_t *data, int n, int pred_order,
+calc_lower_sums(int pmin, int pmax, uint64_t sums[][MAX_PARTITIONS])
+{
+    int i, j;
+
+    for(i=pmax-1; i>=pmin; i--) {
+        for(j=0; j<(1 << i); j++) {
+            sums[i][j] = sums[i+1][2*j] + sums[i+1][2*j+1];
+        }
+    }
+}
+
+/**
+ * Calculate partition sums of the residual, mapped to unsigned values as
+ * for rice coding
+ */
+static void
+calc_sums(int pmin, int pmax, const int32_t *data, int n, int pred_order,
           uint64_t sums[][MAX_PARTITIONS])
 {
     int i, j;
     int parts, cnt;
-    uint32_t *res;
+    const int32_t *res;
 
     // sums for highest level
     parts = (1 << pmax);
@@ -90,52 +145,91 @@ calc_sums(int pmin, int pmax, uint32_t *data, int n, int pred_order,
         if(i > 0) res = &data[i*cnt];
         sums[pmax][i] = 0;
         for(j=0; j<cnt; j++) {
-            sums[pmax][i] += res[j];
+            sums[pmax][i] += (uint32_t)((2*res[j]) ^ (res[j]>>31));
         }
     }
-    // sums for lower levels
-    for(i=pmax-1; i>=pmin; i--) {
-        parts = (1 << i);
-        for(j=0; j<parts; j++) {
-            sums[i][j] = sums[i+1][2*j] + sums[i+1][2*j+1];
+    calc_lower_sums(pmin, pmax, sums);
+}
+
+/**
+ * Lower bound on the bit count of partition order porder, given the residual
+ * bit count (without parameter overhead) of the highest partition order.
+ * Splitting a partition in two never increases the residual bit count, except
+ * by at most 1 bit when both halves have an odd number of samples.
+ */
+static int64_t
+porder_bits_bound(int porder, int pmax, int n, uint32_t pmax_res_bits)
+{
+    int i;
+    int64_t bound = pmax_res_bits + (4 << porder);
+
+    for(i=porder; i<pmax; i++) {
+        if((n >> (i+1)) & 1)
+            bound -= (1 << i);
+    }
+    return bound;
+}
+
+/**
+ * Find the optimal partition order and Rice parameters, given the partition
+ * sums for all partition orders from pmin to pmax.
+ */
+static uint32_t
+calc_rice_params_sums(RiceContext *rc, int pmin, int pmax, int n,
+                      int pred_order, uint64_t sums[][MAX_PARTITIONS])
+{
+    int i;
+    uint32_t bits[MAX_PARTITION_ORDER+1];
+    uint32_t opt_bits, pmax_res_bits;
+    int opt_porder, low_porder, prune;
+    RiceContext tmp_rc, low_rc;
+    uint64_t total;
+
+    // the highest partition order is evaluated first so that its residual
+    // bit count can be used to stop the search over lower orders early.
+    // pruning is only done when no bit count can overflow 32 bits.
+    bits[pmax] = calc_optimal_rice_params(rc, pmax, sums[pmax], n, pred_order);
+    pmax_res_bits = bits[pmax] - (4 << pmax);
+    total = 0;
+    for(i=0; i<(1 << pmin); i++)
+        total += sums[pmin][i];
+    prune = (total + n + 4 * MAX_PARTITIONS <= UINT32_MAX);
+
+    // ties go to the higher partition order
+    opt_bits = bits[pmax];
+    low_porder = -1;
+    for(i=pmin; i<pmax; i++) {
+        if(prune && porder_bits_bound(i, pmax, n, pmax_res_bits) > opt_bits)
+            break;
+        bits[i] = calc_optimal_rice_params(&tmp_rc, i, sums[i], n, pred_order);
+        if(low_porder < 0 || bits[i] <= bits[low_porder]) {
+            low_porder = i;
+            low_rc = tmp_rc;
+            opt_bits = MIN(opt_bits, bits[i]);
         }
     }
+    opt_porder = pmax;
+    if(low_porder >= 0 && bits[low_porder] < bits[pmax]) {
+        opt_porder = low_porder;
+        *rc = low_rc;
+    }
+
+    return bits[opt_porder];
 }
 
 static uint32_t
 calc_rice_params(RiceContext *rc, int pmin, int pmax, int32_t *data, int n,
                  int pred_order)
 {
-    int i;
-    uint32_t bits[MAX_PARTITION_ORDER+1];
-    int opt_porder;
-    RiceContext tmp_rc;
-    uint32_t *udata;
     uint64_t sums[MAX_PARTITION_ORDER+1][MAX_PARTITIONS];
 
     assert(pmin >= 0 && pmin <= MAX_PARTITION_ORDER);
     assert(pmax >= 0 && pmax <= MAX_PARTITION_ORDER);
     assert(pmin <= pmax);
 
-    udata = malloc(n * sizeof(uint32_t));
-    for(i=0; i<n; i++) {
-        udata[i] = (2*data[i]) ^ (data[i]>>31);
-    }
-
-    calc_sums(pmin, pmax, udata, n, pred_order, sums);
-
-    opt_porder = pmin;
-    bits[pmin] = UINT32_MAX;
-    for(i=pmin; i<=pmax; i++) {
-        bits[i] = calc_optimal_rice_params(&tmp_rc, i, sums[i], n, pred_order);
-        if(bits[i] <= bits[opt_porder]) {
-            opt_porder = i;
-            *rc = tmp_rc;
-        }
-    }
+    calc_sums(pmin, pmax, data, n, pred_order, sums);
 
-    free(udata);
-    return bits[opt_porder];
+    return calc_rice_params_sums(rc, pmin, pmax, n, pred_order, sums);
 }
 
 /**
@@ -154,6 +248,19 @@ limit_max_partition_order(int max_porder, int n, int order)
     return porder;
 }
 
+/**
+ * Bits used by the subframe, other than the residual partitions
+ */
+static uint32_t
+calc_header_bits(int pred_order, int bps, int precision,
+                 FlakePrediction pred_type)
+{
+    uint32_t bits = pred_order*bps + 2;
+    if (pred_type == FLAKE_PREDICTION_LEVINSON)
+        bits += 4 + 5 + pred_order*precision;
+    return bits;
+}
+
 static uint32_t calc_rice_params_common(RiceContext *rc, int pmin, int pmax,
                                         int32_t *data, int n, int pred_order,
                                         int bps, int precision,
@@ -162,9 +269,7 @@ static uint32_t calc_rice_params_common(RiceContext *rc, int pmin, int pmax,
     uint32_t bits;
     pmin = limit_max_partition_order(pmin, n, pred_order);
     pmax = limit_max_partition_order(pmax, n, pred_order);
-    bits = pred_order*bps + 2;
-    if (pred_type == FLAKE_PREDICTION_LEVINSON)
-        bits += 4 + 5 + pred_order*precision;
+    bits = calc_header_bits(pred_order, bps, precision, pred_type);
     bits += calc_rice_params(rc, pmin, pmax, data, n, pred_order);
     bits += rc->method + 4;
     return bits;
@@ -185,3 +290,73 @@ calc_rice_params_lpc(RiceContext *rc, int pmin, int pmax, int32_t *data, int n,
     return calc_rice_params_common(rc, pmin, pmax, data, n, pred_order, bps,
                                    precision, FLAKE_PREDICTION_LEVINSON);
 }
+
+void
+rice_bound_init_lpc(RiceBound *rb, int pmin, int pmax, int n, int pred_order,
+                    int bps, int precision)
+{
+    int i;
+
+    rb->pmin = limit_max_partition_order(pmin, n, pred_order);
+    rb->pmax = limit_max_partition_order(pmax, n, pred_order);
+    rb->n = n;
+    rb->pred_order = pred_order;
+    rb->part = 0;
+    rb->total = 0;
+    rb->res_bits = 0;
+    rb->remaining = n - pred_order;
+
+    // fixed part of the bound: header, residual coding method and partition
+    // order fields, and the parameter overhead at the lowest partition order
+    // minus the most that splitting partitions can save (see
+    // porder_bits_bound)
+    rb->header_bits = calc_header_bits(pred_order, bps, precision,
+                                       FLAKE_PREDICTION_LEVINSON);
+    rb->base_bits = rb->header_bits + 4 + (4 << rb->pmin);
+    for(i=rb->pmin; i<rb->pmax; i++) {
+        if((n >> (i+1)) & 1)
+            rb->base_bits -= (1 << i);
+    }
+}
+
+int64_t
+rice_bound_add_partition(RiceBound *rb, const int32_t *res, int cnt)
+{
+    int i, k;
+    uint64_t sum;
+
+    assert(rb->part < (1 << rb->pmax));
+
+    sum = 0;
+    for(i=0; i<cnt; i++) {
+        sum += (uint32_t)((2*res[i]) ^ (res[i]>>31));
+    }
+    rb->sums[rb->pmax][rb->part++] = sum;
+    rb->total += sum;
+    rb->remaining -= cnt;
+
+    // once the bit counts could overflow, the bound is no longer valid
+    if(rb->total + rb->n + 4 * MAX_PARTITIONS > UINT32_MAX)
+        return 0;
+
+    k = find_optimal_rice_param(sum, cnt);
+    rb->res_bits += rice_encode_count(sum, cnt, k);
+
+    // each remaining residual sample costs at least half a bit
+    return rb->base_bits + rb->res_bits + (rb->remaining >> 1);
+}
+
+uint32_t
+rice_bound_finish(RiceBound *rb, RiceContext *rc)
+{
+    uint32_t bits;
+
+    assert(rb->part == (1 << rb->pmax));
+
+    calc_lower_sums(rb->pmin, rb->pmax, rb->sums);
+    bits = rb->header_bits;
+    bits += calc_rice_params_sums(rc, rb->pmin, rb->pmax, rb->n,
+                                  rb->pred_order, rb->sums);
+    bits += rc->method + 4;
+    return bits;
+}
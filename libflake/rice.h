@@ -45,6 +45,23 @@ typedef struct RiceContext {
     int esc_bps[MAX_PARTITIONS];    /* bps if using escape code */
 } RiceContext;
 
+/**
+ * State for calculating a lower bound on the subframe bit count while the
+ * residual is being generated one partition at a time
+ */
+typedef struct RiceBound {
+    int pmin, pmax;                 /* limited partition order range */
+    int n;
+    int pred_order;
+    int part;                       /* next partition at order pmax */
+    int remaining;                  /* residual samples not yet added */
+    uint32_t header_bits;
+    int64_t base_bits;
+    int64_t res_bits;               /* exact bits for partitions added */
+    uint64_t total;
+    uint64_t sums[MAX_PARTITION_ORDER+1][MAX_PARTITIONS];
+} RiceBound;
+
 #define rice_encode_count(sum, n, k) (((n)*((k)+1))+(((sum)-(n>>1))>>(k)))
 
 extern int find_optimal_rice_param(uint64_t sum, int n);
@@ -57,4 +74,24 @@ extern uint32_t calc_rice_params_lpc(RiceContext *rc, int pmin, int pmax,
                                      int32_t *data, int n, int pred_order,
                                      int bps, int precision);
 
+/**
+ * Initialize a bound for an LPC subframe.  The residual must be added in
+ * partitions of the limited maximum partition order, rb->pmax.
+ */
+extern void rice_bound_init_lpc(RiceBound *rb, int pmin, int pmax, int n,
+                                int pred_order, int bps, int precision);
+
+/**
+ * Add the next residual partition.
+ * @return lower bound on the final subframe bit count
+ */
+extern int64_t rice_bound_add_partition(RiceBound *rb, const int32_t *res,
+                                        int cnt);
+
+/**
+ * Calculate the optimal Rice parameters once all partitions have been added.
+ * @return same bit count as calc_rice_params_lpc()
+ */
+extern uint32_t rice_bound_finish(RiceBound *rb, RiceContext *rc);
+
 #endif /* RICE_H */
@@ -0,0 +1,151 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * Flake is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Flake is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Flake; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// clock_gettime() is hidden by -std=c99 otherwise
+#define _POSIX_C_SOURCE 200112L
+
+#include "common.h"
+
+#include <time.h>
+
+#include "flake.h"
+#include "speed.h"
+#include "encode.h"
+
+/** time which can be saved up or owed, in frames */
+#define SPEED_CREDIT_FRAMES 4
+
+double
+speed_get_time(void)
+{
+    clock_t c;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    if(!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+    c = clock();
+    return (double)c / CLOCKS_PER_SEC;
+}
+
+double
+speed_get_wall_time(void)
+{
+    clock_t c;
+#if defined(HAVE_CLOCK_GETTIME)
+    struct timespec ts;
+    if(!clock_gettime(CLOCK_MONOTONIC, &ts))
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+    c = clock();
+    return (double)c / CLOCKS_PER_SEC;
+}
+
+/**
+ * Each compression level from 0 up to the one requested is a candidate.
+ * The lower levels take the analysis settings of their presets, limited to
+ * those of the requested parameters, which are used as the top level.  The
+ * limit keeps the levels in order of cost: the VBS search of -v 2, for
+ * instance, is only used by the top level.  The block size and stream
+ * options are never changed.
+ */
+void
+speed_init(FlacEncodeContext *ctx)
+{
+    int lvl;
+    FlakeEncodeParams preset;
+    FlakeEncodeParams *p;
+    SpeedControl *sc;
+
+    sc = &ctx->speed;
+    memset(sc, 0, sizeof(SpeedControl));
+    sc->levels = ctx->params.compression + 1;
+    for(lvl=0; lvl<sc->levels; lvl++) {
+        p = &sc->params[lvl];
+        *p = ctx->params;
+        if(lvl == ctx->params.compression)
+            break;
+        preset.compression = lvl;
+        flake_set_defaults(&preset);
+        p->order_method = preset.order_method;
+        p->stereo_method = MIN(p->stereo_method, preset.stereo_method);
+        p->prediction_type = MIN(p->prediction_type, preset.prediction_type);
+        p->max_prediction_order = MIN(p->max_prediction_order,
+                                      preset.max_prediction_order);
+        p->min_prediction_order = MIN(preset.min_prediction_order,
+                                      p->max_prediction_order);
+        p->max_partition_order = MIN(p->max_partition_order,
+                                     preset.max_partition_order);
+        p->min_partition_order = MIN(preset.min_partition_order,
+                                     p->max_partition_order);
+        p->variable_block_size = MIN(p->variable_block_size,
+                                     preset.variable_block_size);
+    }
+
+    // start at the fastest level and let spare time raise it
+    sc->level = 0;
+}
+
+void
+speed_select_level(FlacEncodeContext *ctx)
+{
+    ctx->params = ctx->speed.params[ctx->speed.level];
+}
+
+/**
+ * The cost per sample of each level is tracked while it is in use.  When the
+ * encoder falls behind the target, it drops to the highest level whose cost
+ * fits the frame budget, and at least one level.  When it has time to spare,
+ * it moves up one level if that is expected to fit in the budget plus the
+ * time saved.  A level not yet measured is assumed to cost twice as much as
+ * the current one.
+ */
+void
+speed_update(FlacEncodeContext *ctx, int block_size, double elapsed)
+{
+    int lvl, bs;
+    double rate, cost, next, budget, limit;
+    SpeedControl *sc;
+
+    sc = &ctx->speed;
+    lvl = sc->level;
+    bs = ctx->params.block_size;
+    rate = (double)ctx->samplerate * ctx->params.target_speed;
+
+    cost = elapsed / block_size;
+    if(sc->cost[lvl] > 0)
+        cost = (3.0 * sc->cost[lvl] + cost) / 4.0;
+    sc->cost[lvl] = cost;
+
+    budget = bs / rate;
+    limit = SPEED_CREDIT_FRAMES * budget;
+    sc->credit = CLIP(sc->credit + block_size / rate - elapsed, -limit, limit);
+
+    if(sc->credit < 0) {
+        while(lvl > 0 && sc->cost[lvl] * bs > budget)
+            lvl--;
+        if(lvl == sc->level && lvl > 0)
+            lvl--;
+    } else if(lvl+1 < sc->levels) {
+        next = sc->cost[lvl+1] > 0 ? sc->cost[lvl+1] : 2.0 * cost;
+        if(next * bs <= budget + sc->credit)
+            lvl++;
+    }
+    sc->level = lvl;
+}
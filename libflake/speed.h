@@ -0,0 +1,52 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * Flake is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Flake is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Flake; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SPEED_H
+#define SPEED_H
+
+#include "common.h"
+#include "encode.h"
+
+/**
+ * Returns the CPU time used by the calling thread, in seconds
+ */
+extern double speed_get_time(void);
+
+/**
+ * Returns a monotonic wall-clock time, in seconds
+ */
+extern double speed_get_wall_time(void);
+
+/**
+ * Build the compression levels used to meet params.target_speed
+ */
+extern void speed_init(FlacEncodeContext *ctx);
+
+/**
+ * Set the encoding parameters for the next frame
+ */
+extern void speed_select_level(FlacEncodeContext *ctx);
+
+/**
+ * Account for the time taken by the frame just encoded
+ */
+extern void speed_update(FlacEncodeContext *ctx, int block_size,
+                         double elapsed);
+
+#endif /* SPEED_H */
@@ -31,32 +31,25 @@
  * by first summing the absolute value of fixed 2nd order residual, averaged
  * across all channels.  The predictability is compared between adjacent
  * sections to determine if they should be merged based on a fixed comparison
- * threshold.
+ * threshold.  The samples are read from the subframes of the frame.
  */
 static void
-split_frame_v1(const int32_t *samples, int channels, int block_size,
+split_frame_v1(const FlacFrame *frame, int channels, int block_size,
                int *frames, int sizes[VBS_MAX_FRAMES])
 {
     int i, ch, j;
     int n = block_size / VBS_MAX_FRAMES;
     int64_t res[VBS_MAX_FRAMES];
     int layout[VBS_MAX_FRAMES];
-    const int32_t *sptr, *sptr0, *sptr1, *sptr2;
+    const int32_t *sptr;
 
     // calculate absolute sum of 2nd order residual
     for(i=0; i<VBS_MAX_FRAMES; i++) {
-        sptr = &samples[i*n*channels];
         res[i] = 0;
         for(ch=0; ch<channels; ch++) {
-            sptr0 = sptr + (2*channels+ch);
-            sptr1 = sptr0 - channels;
-            sptr2 = sptr1 - channels;
-            for(j=2; j<n; j++) {
-                res[i] += abs((*sptr0) - 2*(*sptr1) + (*sptr2));
-                sptr0 += channels;
-                sptr1 += channels;
-                sptr2 += channels;
-            }
+            sptr = &frame->subframes[ch].samples[i*n];
+            for(j=2; j<n; j++)
+                res[i] += abs(sptr[j] - 2*sptr[j-1] + sptr[j-2]);
         }
         res[i] /= channels;
         res[i]++;
@@ -82,29 +75,204 @@ split_frame_v1(const int32_t *samples, int channels, int block_size,
     }
 }
 
+/** number of aligned sub-blocks in the split tree */
+#define VBS_TREE_NODES ((1 << VBS_SEARCH_LEVELS) - 1)
+
+/**
+ * Copy the encoded frames of the chosen layout below a tree node
+ * Returns the new position in the frame buffer.
+ */
+static int
+output_vbs_node(FlacEncodeContext *ctx, int node, const int split[],
+                const int offset[], const int bytes[], int fpos)
+{
+    if(split[node]) {
+        fpos = output_vbs_node(ctx, 2*node+1, split, offset, bytes, fpos);
+        return output_vbs_node(ctx, 2*node+2, split, offset, bytes, fpos);
+    }
+    memcpy(&ctx->frame_out[fpos], &ctx->vbs_buffer[offset[node]],
+           bytes[node]);
+    return fpos + bytes[node];
+}
+
+/**
+ * Record the LPC coefficients of the frame just encoded as a hint for a
+ * sub-block below it.
+ */
+static void
+set_parent_hint(const FlacEncodeContext *ctx, FrameHint *hint)
+{
+    int ch, src;
+    const FlacFrame *frame;
+    const FlacSubframe *sub;
+
+    frame = &ctx->frame;
+    memset(hint->order, 0, sizeof(hint->order));
+    for(ch=0; ch<ctx->channels; ch++) {
+        sub = &frame->subframes[ch];
+        if(sub->type == FLAC_SUBFRAME_LPC) {
+            src = channel_source(frame->ch_mode, ch);
+            hint->order[src] = sub->order;
+            hint->shift[src] = sub->shift;
+            memcpy(hint->coefs[src], sub->coefs, sub->order * sizeof(int32_t));
+        }
+    }
+}
+
+/**
+ * Calculate the stereo decorrelation sums of every node from those of the
+ * smallest sub-blocks.  The residual of the first 2 samples of a sub-block
+ * depends on the one before it, so it is summed separately and only added
+ * when both are in the same node.
+ */
+static void
+calc_hint_decorr_sums(const int32_t *left, const int32_t *right,
+                      int block_size, FrameHint hint[VBS_TREE_NODES])
+{
+    int i, j, k, node, level, first, count;
+    int n = block_size / VBS_MAX_FRAMES;
+    uint64_t leaf[VBS_MAX_FRAMES][4], edge[VBS_MAX_FRAMES][4];
+
+    for(i=0; i<VBS_MAX_FRAMES; i++) {
+        calc_decorr_sums(left, right, 1, i*n+2, (i+1)*n, leaf[i]);
+        if(i > 0)
+            calc_decorr_sums(left, right, 1, i*n, i*n+2, edge[i]);
+    }
+
+    for(node=0; node<VBS_TREE_NODES; node++) {
+        level = log2i(node+1);
+        count = VBS_MAX_FRAMES >> level;
+        first = (node + 1 - (1 << level)) * count;
+        for(k=0; k<4; k++) {
+            hint[node].decorr_sums[k] = 0;
+            for(j=first; j<first+count; j++) {
+                hint[node].decorr_sums[k] += leaf[j][k];
+                if(j > first)
+                    hint[node].decorr_sums[k] += edge[j][k];
+            }
+        }
+    }
+}
+
+/**
+ * Split frame by searching all aligned sub-block layouts.
+ * Every sub-block of size N, N/2, N/4 and N/8 is encoded once, into the
+ * scratch buffer, with the sample number it would have in the output.  The
+ * cheapest layout is found bottom-up by comparing each node with the sum of
+ * its two children, and the chosen frames are copied without re-encoding.
+ * Each level starts from the LPC history of the previous frame, and the
+ * history left after the block is that of the last frame written.
+ * Analysis is shared through FrameHint: the stereo decision sums are
+ * combined from the smallest sub-blocks, and each sub-block also tries the
+ * LPC coefficients chosen for the block enclosing it.
+ */
+static int
+encode_frame_vbs_search(FlacEncodeContext *ctx, const InputBlock *in,
+                        int block_size)
+{
+    int node, level, n, start, fs, pos;
+    InputBlock sub;
+    int offset[VBS_TREE_NODES], bytes[VBS_TREE_NODES];
+    int cost[VBS_TREE_NODES], split[VBS_TREE_NODES];
+    uint64_t fc0;
+    LpcHistory last0, last[VBS_SEARCH_LEVELS];
+    FrameHint hint[VBS_TREE_NODES];
+
+    if(!ctx->vbs_buffer)
+        return -1;
+
+    fc0 = ctx->frame_count;
+    last0 = ctx->last;
+
+    memset(hint, 0, sizeof(hint));
+    if(ctx->channels == 2 &&
+       ctx->params.stereo_method == FLAKE_STEREO_METHOD_ESTIMATE) {
+        copy_input(ctx, in, block_size);
+        calc_hint_decorr_sums(ctx->frame.subframes[0].samples,
+                              ctx->frame.subframes[1].samples, block_size,
+                              hint);
+    }
+
+    // nodes are in heap order.  node 0 is the whole block and the children
+    // of node k are 2k+1 and 2k+2.
+    sub = *in;
+    pos = 0;
+    for(node=0; node<VBS_TREE_NODES; node++) {
+        level = log2i(node+1);
+        n = block_size >> level;
+        start = (node + 1 - (1 << level)) * n;
+        if(!start)
+            ctx->last = last0;
+        ctx->frame_count = fc0 + start;
+        ctx->hint = &hint[node];
+        sub.offset = in->offset + start;
+        fs = encode_frame(ctx, &ctx->vbs_buffer[pos], ctx->vbs_buffer_size-pos,
+                          &sub, n);
+        ctx->hint = NULL;
+        if(fs < 0) {
+            ctx->frame_count = fc0;
+            ctx->last = last0;
+            return -1;
+        }
+        offset[node] = pos;
+        bytes[node] = fs;
+        pos += fs;
+        if(start + n == block_size)
+            last[level] = ctx->last;
+        if(2*node+2 < VBS_TREE_NODES) {
+            set_parent_hint(ctx, &hint[2*node+1]);
+            set_parent_hint(ctx, &hint[2*node+2]);
+        }
+    }
+
+    for(node=VBS_TREE_NODES-1; node>=0; node--) {
+        cost[node] = bytes[node];
+        split[node] = 0;
+        if(2*node+2 < VBS_TREE_NODES &&
+                cost[2*node+1] + cost[2*node+2] < cost[node]) {
+            cost[node] = cost[2*node+1] + cost[2*node+2];
+            split[node] = 1;
+        }
+    }
+
+    // the last frame written is on the right edge of the tree
+    node = 0;
+    while(split[node])
+        node = 2*node+2;
+    ctx->last = last[log2i(node+1)];
+
+    ctx->frame_count = fc0 + block_size;
+    return output_vbs_node(ctx, 0, split, offset, bytes, 0);
+}
+
 int
-encode_frame_vbs(FlacEncodeContext *ctx, const int32_t *samples, int block_size)
+encode_frame_vbs(FlacEncodeContext *ctx, const InputBlock *in, int block_size)
 {
     int fs = -1;
     int frames;
     int sizes[VBS_MAX_FRAMES];
-    int fc0;
+    uint64_t fc0;
 
-    if(!ctx || !samples || block_size < VBS_MIN_BLOCK_SIZE || block_size % VBS_MAX_FRAMES)
+    if(!ctx || !in || block_size < VBS_MIN_BLOCK_SIZE || block_size % VBS_MAX_FRAMES)
         return -1;
 
+    if(ctx->params.variable_block_size == 2)
+        return encode_frame_vbs_search(ctx, in, block_size);
+
     fc0 = ctx->frame_count;
 
-    split_frame_v1(samples, ctx->channels, block_size, &frames, sizes);
+    copy_input(ctx, in, block_size);
+    split_frame_v1(&ctx->frame, ctx->channels, block_size, &frames, sizes);
 
     if(frames > 1) {
         int i, fpos, spos;
+        InputBlock sub = *in;
         fpos = 0;
         spos = 0;
         for(i=0; i<frames; i++) {
-            fs = encode_frame(ctx, &ctx->frame_buffer[fpos],
-                              ctx->frame_buffer_size-fpos,
-                              &samples[spos*ctx->channels], sizes[i]);
+            sub.offset = in->offset + spos;
+            fs = encode_frame(ctx, &ctx->frame_out[fpos],
+                              ctx->frame_buffer_size-fpos, &sub, sizes[i]);
             if(fs < 0) {
                 ctx->frame_count = fc0;
                 return -1;
@@ -27,7 +27,10 @@
 
 #define VBS_MIN_BLOCK_SIZE (VBS_MAX_FRAMES * FLAC_MIN_BLOCKSIZE)
 
-extern int encode_frame_vbs(FlacEncodeContext *ctx, const int32_t *samples,
+/** number of block sizes tried by the VBS search: N, N/2, N/4 and N/8 */
+#define VBS_SEARCH_LEVELS 4
+
+extern int encode_frame_vbs(FlacEncodeContext *ctx, const InputBlock *in,
                             int block_size);
 
 #endif /* VBS_H */
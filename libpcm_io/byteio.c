@@ -22,39 +22,527 @@
  * Byte buffer
  */
 
+// fileno(), fseeko(), fstat(), read() and posix_madvise() are hidden by
+// -std=c99 otherwise
+#define _POSIX_C_SOURCE 200112L
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define lseek _lseeki64
+#else
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_POSIX_FADVISE
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "pcm_io_common.h"
 #include "byteio.h"
 
+static int
+file_read(void *opaque, void *buf, int size)
+{
+    FILE *fp = opaque;
+    size_t nr = fread(buf, 1, size, fp);
+
+    if(!nr && ferror(fp))
+        return -1;
+    return (int)nr;
+}
+
+static int
+file_seek(void *opaque, int64_t offset, int whence)
+{
+#if defined(_WIN32)
+    return _fseeki64(opaque, offset, whence);
+#elif defined(HAVE_FSEEKO)
+    return fseeko(opaque, (off_t)offset, whence);
+#else
+    if(offset < LONG_MIN || offset > LONG_MAX)
+        return -1;
+    return fseek(opaque, (long)offset, whence);
+#endif
+}
+
+static int64_t
+file_tell(void *opaque)
+{
+#if defined(_WIN32)
+    return _ftelli64(opaque);
+#elif defined(HAVE_FSEEKO)
+    return ftello(opaque);
+#else
+    return ftell(opaque);
+#endif
+}
+
+static const ByteIOCallbacks file_callbacks = {
+    file_read, file_seek, file_tell
+};
+
+#ifdef _WIN32
+// in Windows, don't try to detect seeking support for stdin
+static const ByteIOCallbacks stdin_callbacks = { file_read, NULL, NULL };
+#endif
+
+static int
+fd_read(void *opaque, void *buf, int size)
+{
+    return (int)read((int)(intptr_t)opaque, buf, size);
+}
+
+static int
+fd_seek(void *opaque, int64_t offset, int whence)
+{
+    return (lseek((int)(intptr_t)opaque, offset, whence) < 0) ? -1 : 0;
+}
+
+static int64_t
+fd_tell(void *opaque)
+{
+    return lseek((int)(intptr_t)opaque, 0, SEEK_CUR);
+}
+
+static const ByteIOCallbacks fd_callbacks = {
+    fd_read, fd_seek, fd_tell
+};
+
+#ifdef HAVE_MMAP
+/**
+ * Map the whole file if it is a regular file.  Returns -1 if it cannot be
+ * mapped.
+ */
+static int
+byteio_map(ByteIOContext *ctx, int fd)
+{
+    struct stat st;
+    void *map;
+
+    if(fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return -1;
+    if((uint64_t)st.st_size > SIZE_MAX)
+        return -1;
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+        return -1;
+    posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    ctx->map = map;
+    ctx->map_size = (uint64_t)st.st_size;
+    ctx->map_pos = 0;
+    ctx->mapped = 1;
+    return 0;
+}
+#endif
+
+/**
+ * Each block starts with its size, which keeps the count without asking the
+ * allocator, and is padded to keep the alignment of the block.
+ */
+#define BYTEIO_MEM_HEADER_SIZE 16
+
+void *
+byteio_alloc(ByteIOContext *ctx, size_t size)
+{
+    unsigned char *block;
+
+    if(size > SIZE_MAX - BYTEIO_MEM_HEADER_SIZE)
+        return NULL;
+    size += BYTEIO_MEM_HEADER_SIZE;
+    if(ctx->allocator.alloc)
+        block = ctx->allocator.alloc(ctx->allocator.opaque, size);
+    else
+        block = malloc(size);
+    if(!block)
+        return NULL;
+    *(size_t *)block = size;
+    ctx->mem_current += size;
+    ctx->mem_peak = MAX(ctx->mem_peak, ctx->mem_current);
+    return block + BYTEIO_MEM_HEADER_SIZE;
+}
+
+void
+byteio_free(ByteIOContext *ctx, void *ptr)
+{
+    unsigned char *block;
+
+    if(!ptr)
+        return;
+    block = (unsigned char *)ptr - BYTEIO_MEM_HEADER_SIZE;
+    ctx->mem_current -= *(size_t *)block;
+    if(ctx->allocator.free)
+        ctx->allocator.free(ctx->allocator.opaque, block);
+    else
+        free(block);
+}
+
 int
-byteio_init(ByteIOContext *ctx, FILE *fp)
+byteio_set_allocator(ByteIOContext *ctx, const ByteIOAllocator *allocator)
 {
-    ctx->buffer = calloc(BYTEIO_BUFFER_SIZE, 1);
+    ByteIOAllocator old_allocator, new_allocator;
+    unsigned char *buffer;
+
+    if(ctx->ra)
+        return -1;
+    if(allocator && (!allocator->alloc || !allocator->free))
+        return -1;
+
+    old_allocator = ctx->allocator;
+    if(allocator)
+        ctx->allocator = *allocator;
+    else
+        memset(&ctx->allocator, 0, sizeof(ByteIOAllocator));
+
+    // the buffer can hold data which is not read yet
+    if(ctx->buffer) {
+        buffer = byteio_alloc(ctx, BYTEIO_BUFFER_SIZE);
+        if(!buffer) {
+            ctx->allocator = old_allocator;
+            return -1;
+        }
+        memcpy(buffer, ctx->buffer, BYTEIO_BUFFER_SIZE);
+        // the old buffer goes back to the allocator it came from
+        new_allocator = ctx->allocator;
+        ctx->allocator = old_allocator;
+        byteio_free(ctx, ctx->buffer);
+        ctx->allocator = new_allocator;
+        ctx->buffer = buffer;
+    }
+    return 0;
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ * Ring of chunks filled by a background thread.  The reader thread owns
+ * the free chunks and the consumer owns the filled ones, so the data is
+ * copied without holding the lock.
+ */
+typedef struct ByteIOReadAhead {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const ByteIOCallbacks *cb;
+    void *opaque;
+    unsigned char **chunk;
+    int *fill;                  ///< bytes in each chunk
+    int chunks;
+    int chunk_size;
+    int read_size;              ///< largest single read into a chunk
+    int head;                   ///< first filled chunk
+    int count;                  ///< number of filled chunks
+    int pos;                    ///< bytes already taken from the head chunk
+    int eof;
+    int quit;
+    int running;
+} ByteIOReadAhead;
+
+static void *
+read_ahead_thread(void *arg)
+{
+    ByteIOReadAhead *ra = arg;
+    int slot, nr;
+
+    pthread_mutex_lock(&ra->lock);
+    while(!ra->quit && !ra->eof) {
+        if(ra->count == ra->chunks) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+        slot = (ra->head + ra->count) % ra->chunks;
+        pthread_mutex_unlock(&ra->lock);
+
+        // each read is handed over as it completes.  a stdio read blocks
+        // until it is full, so a stream which cannot seek is read in pieces
+        // of the unthreaded buffer size and is not held back any longer.
+        nr = ra->cb->read(ra->opaque, ra->chunk[slot], ra->read_size);
+
+        pthread_mutex_lock(&ra->lock);
+        if(nr > 0) {
+            ra->fill[slot] = nr;
+            ra->count++;
+        } else {
+            ra->eof = 1;
+        }
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+static int
+read_ahead_start(ByteIOReadAhead *ra)
+{
+    ra->head = ra->count = ra->pos = 0;
+    ra->eof = ra->quit = 0;
+    ra->running = !pthread_create(&ra->thread, NULL, read_ahead_thread, ra);
+    return ra->running ? 0 : -1;
+}
+
+static void
+read_ahead_stop(ByteIOReadAhead *ra)
+{
+    if(!ra->running)
+        return;
+    pthread_mutex_lock(&ra->lock);
+    ra->quit = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+    ra->running = 0;
+}
+
+static void
+read_ahead_free(ByteIOContext *ctx, ByteIOReadAhead *ra)
+{
+    int i;
+
+    read_ahead_stop(ra);
+    if(ra->chunk) {
+        for(i=0; i<ra->chunks; i++)
+            byteio_free(ctx, ra->chunk[i]);
+    }
+    byteio_free(ctx, ra->chunk);
+    byteio_free(ctx, ra->fill);
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->cond);
+    byteio_free(ctx, ra);
+}
+
+/**
+ * Take n bytes from the filled chunks, waiting for the reader thread as
+ * needed.  Returns fewer only at the end of the stream.
+ */
+static int
+read_ahead_read(ByteIOReadAhead *ra, unsigned char *buf, int n)
+{
+    int nc, count = 0;
+
+    pthread_mutex_lock(&ra->lock);
+    while(count < n) {
+        while(!ra->count && !ra->eof)
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        if(!ra->count)
+            break;
+        pthread_mutex_unlock(&ra->lock);
+
+        nc = MIN(n - count, ra->fill[ra->head] - ra->pos);
+        memcpy(&buf[count], &ra->chunk[ra->head][ra->pos], nc);
+        count += nc;
+        ra->pos += nc;
+
+        pthread_mutex_lock(&ra->lock);
+        if(ra->pos == ra->fill[ra->head]) {
+            ra->head = (ra->head + 1) % ra->chunks;
+            ra->count--;
+            ra->pos = 0;
+            pthread_cond_broadcast(&ra->cond);
+        }
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return count;
+}
+#endif /* HAVE_PTHREAD */
+
+int
+byteio_set_read_ahead(ByteIOContext *ctx, int chunk_size, int chunks)
+{
+#ifdef HAVE_PTHREAD
+    ByteIOReadAhead *ra;
+    int i;
+
+    if(ctx->map)
+        return 0;
+    if(!ctx->cb || ctx->ra || chunk_size < 0 || chunks < 0)
+        return -1;
+    if(!chunk_size)
+        chunk_size = BYTEIO_READ_AHEAD_SIZE;
+    if(!chunks)
+        chunks = BYTEIO_READ_AHEAD_CHUNKS;
+
+    ra = byteio_alloc(ctx, sizeof(ByteIOReadAhead));
+    if(!ra)
+        return -1;
+    memset(ra, 0, sizeof(ByteIOReadAhead));
+    ra->cb = ctx->cb;
+    ra->opaque = ctx->opaque;
+    ra->chunk_size = chunk_size;
+    ra->read_size = chunk_size;
+    if(!ctx->seekable)
+        ra->read_size = MIN(chunk_size, BYTEIO_BUFFER_SIZE);
+    ra->chunks = chunks;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    ra->chunk = byteio_alloc(ctx, chunks * sizeof(unsigned char *));
+    ra->fill = byteio_alloc(ctx, chunks * sizeof(int));
+    if(!ra->chunk || !ra->fill) {
+        read_ahead_free(ctx, ra);
+        return -1;
+    }
+    memset(ra->chunk, 0, chunks * sizeof(unsigned char *));
+    memset(ra->fill, 0, chunks * sizeof(int));
+    for(i=0; i<chunks; i++) {
+        ra->chunk[i] = byteio_alloc(ctx, chunk_size);
+        if(!ra->chunk[i]) {
+            read_ahead_free(ctx, ra);
+            return -1;
+        }
+    }
+    if(read_ahead_start(ra)) {
+        read_ahead_free(ctx, ra);
+        return -1;
+    }
+    ctx->ra = ra;
+    return 0;
+#else
+    (void)ctx;
+    (void)chunk_size;
+    (void)chunks;
+    return -1;
+#endif
+}
+
+/**
+ * Read a full n bytes unless the stream ends first
+ */
+static int
+fill_buffer(ByteIOContext *ctx, unsigned char *buf, int n)
+{
+    int nr, count = 0;
+
+#ifdef HAVE_PTHREAD
+    if(ctx->ra)
+        return read_ahead_read(ctx->ra, buf, n);
+#endif
+    while(count < n) {
+        nr = ctx->cb->read(ctx->opaque, &buf[count], n - count);
+        if(nr <= 0)
+            break;
+        count += nr;
+    }
+    return count;
+}
+
+/**
+ * Set up a stream, find its size if it can seek, and map it if it is a
+ * regular file.  fd is -1 if the stream has no file descriptor.
+ */
+static int
+byteio_open(ByteIOContext *ctx, const ByteIOCallbacks *cb, void *opaque,
+            int fd)
+{
+    int64_t size;
+
+    memset(ctx, 0, sizeof(ByteIOContext));
+    ctx->cb = cb;
+    ctx->opaque = opaque;
+
+    // attempt to get file size
+    if(cb->seek && cb->tell && !cb->seek(opaque, 0, SEEK_END)) {
+        ctx->seekable = 1;
+        size = cb->tell(opaque);
+        if(size < 0) {
+            fprintf(stderr, "Warning, unsupported file size.\n");
+        } else {
+            ctx->file_size = (uint64_t)size;
+        }
+        cb->seek(opaque, 0, SEEK_SET);
+    }
+
+#ifdef HAVE_MMAP
+    if(fd >= 0 && ctx->seekable && !byteio_map(ctx, fd))
+        return 0;
+#endif
+#ifdef HAVE_POSIX_FADVISE
+    // a file which is read, not mapped, is still read in order
+    if(fd >= 0 && ctx->seekable)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    (void)fd;
+    ctx->buffer = byteio_alloc(ctx, BYTEIO_BUFFER_SIZE);
     if(!ctx->buffer)
         return -1;
-    ctx->fp = fp;
-    ctx->index = 0;
-    ctx->size = 0;
+    memset(ctx->buffer, 0, BYTEIO_BUFFER_SIZE);
     byteio_flush(ctx);
     return 0;
 }
 
+int
+byteio_init(ByteIOContext *ctx, FILE *fp)
+{
+#ifdef _WIN32
+    if(fp == stdin)
+        return byteio_open(ctx, &stdin_callbacks, fp, -1);
+#endif
+    return byteio_open(ctx, &file_callbacks, fp, fileno(fp));
+}
+
+int
+byteio_init_fd(ByteIOContext *ctx, int fd)
+{
+    if(fd < 0)
+        return -1;
+    return byteio_open(ctx, &fd_callbacks, (void *)(intptr_t)fd, fd);
+}
+
+int
+byteio_init_mem(ByteIOContext *ctx, const void *data, uint64_t size)
+{
+    if(!data && size)
+        return -1;
+    memset(ctx, 0, sizeof(ByteIOContext));
+    ctx->map = data;
+    ctx->map_size = size;
+    ctx->seekable = 1;
+    ctx->file_size = size;
+    return 0;
+}
+
+int
+byteio_init_callbacks(ByteIOContext *ctx, const ByteIOCallbacks *cb,
+                      void *opaque)
+{
+    if(!cb || !cb->read)
+        return -1;
+    return byteio_open(ctx, cb, opaque, -1);
+}
+
 void
 byteio_align(ByteIOContext *ctx)
 {
+    if(ctx->map)
+        return;
     memmove(ctx->buffer, &ctx->buffer[ctx->index], ctx->size);
-    ctx->size += fread(&ctx->buffer[ctx->size], 1, BYTEIO_BUFFER_SIZE-ctx->size,
-                       ctx->fp);
+    ctx->size += fill_buffer(ctx, &ctx->buffer[ctx->size],
+                             BYTEIO_BUFFER_SIZE-ctx->size);
     ctx->index = 0;
 }
 
 int
 byteio_flush(ByteIOContext *ctx)
 {
+    if(ctx->map)
+        return (int)MIN(ctx->map_size - ctx->map_pos, INT32_MAX);
     ctx->index = 0;
-    ctx->size = fread(ctx->buffer, 1, BYTEIO_BUFFER_SIZE, ctx->fp);
+    ctx->size = fill_buffer(ctx, ctx->buffer, BYTEIO_BUFFER_SIZE);
     return ctx->size;
 }
 
@@ -62,8 +550,15 @@ int
 byteio_read(void *ptr, int n, ByteIOContext *ctx)
 {
     unsigned char *ptr8 = ptr;
+    const unsigned char *data;
     int count = 0;
 
+    if(ctx->map) {
+        count = byteio_read_direct(&data, n, ctx);
+        if(count > 0)
+            memcpy(ptr, data, count);
+        return count;
+    }
     while(n > ctx->size) {
         memcpy(&ptr8[count], &ctx->buffer[ctx->index], ctx->size);
         count += ctx->size;
@@ -85,6 +580,11 @@ byteio_peek(void *ptr, int n, ByteIOContext *ctx)
 {
     int nr;
 
+    if(ctx->map) {
+        nr = (int)MIN((uint64_t)MAX(n, 0), ctx->map_size - ctx->map_pos);
+        memcpy(ptr, &ctx->map[ctx->map_pos], nr);
+        return nr;
+    }
     if(n > ctx->size)
         byteio_align(ctx);
     nr = MIN(n, ctx->size);
@@ -92,13 +592,78 @@ byteio_peek(void *ptr, int n, ByteIOContext *ctx)
     return nr;
 }
 
+int
+byteio_read_direct(const unsigned char **data, int n, ByteIOContext *ctx)
+{
+    int nr;
+
+    if(!ctx->map)
+        return -1;
+    nr = (int)MIN((uint64_t)MAX(n, 0), ctx->map_size - ctx->map_pos);
+    *data = &ctx->map[ctx->map_pos];
+    ctx->map_pos += nr;
+    return nr;
+}
+
+int
+byteio_seek(ByteIOContext *ctx, uint64_t pos)
+{
+    if(ctx->map) {
+        if(pos > ctx->map_size)
+            return -1;
+        ctx->map_pos = pos;
+        return 0;
+    }
+    if(!ctx->cb || !ctx->cb->seek || pos > INT64_MAX)
+        return -1;
+#ifdef HAVE_PTHREAD
+    // the reader thread is ahead of the stream position, so it is stopped
+    // while seeking and its chunks are dropped
+    if(ctx->ra) {
+        int err;
+        read_ahead_stop(ctx->ra);
+        err = ctx->cb->seek(ctx->opaque, (int64_t)pos, SEEK_SET);
+        if(read_ahead_start(ctx->ra)) {
+            read_ahead_free(ctx, ctx->ra);
+            ctx->ra = NULL;
+        }
+        if(err)
+            return -1;
+        byteio_flush(ctx);
+        return 0;
+    }
+#endif
+    if(ctx->cb->seek(ctx->opaque, (int64_t)pos, SEEK_SET))
+        return -1;
+    byteio_flush(ctx);
+    return 0;
+}
+
+int
+byteio_is_open(const ByteIOContext *ctx)
+{
+    return ctx->cb != NULL || ctx->map != NULL;
+}
+
 void
 byteio_close(ByteIOContext *ctx)
 {
     if(ctx) {
-        ctx->fp = NULL;
-        if(ctx->buffer)
-            free(ctx->buffer);
+#ifdef HAVE_PTHREAD
+        if(ctx->ra)
+            read_ahead_free(ctx, ctx->ra);
+        ctx->ra = NULL;
+#endif
+#ifdef HAVE_MMAP
+        if(ctx->mapped)
+            munmap((void *)ctx->map, (size_t)ctx->map_size);
+#endif
+        ctx->map = NULL;
+        ctx->mapped = 0;
+        ctx->cb = NULL;
+        ctx->opaque = NULL;
+        byteio_free(ctx, ctx->buffer);
+        ctx->buffer = NULL;
         ctx->index = 0;
         ctx->size = 0;
     }
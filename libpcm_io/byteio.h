@@ -26,18 +26,117 @@
 #define BYTEIO_H
 
 #include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
 
 #define BYTEIO_BUFFER_SIZE 16384
 
+/** default read-ahead: three chunks of 1 MB */
+#define BYTEIO_READ_AHEAD_SIZE   (1 << 20)
+#define BYTEIO_READ_AHEAD_CHUNKS 3
+
+/**
+ * Input stream functions
+ * read returns the number of bytes read, 0 at the end of the stream or -1
+ * on error.  seek works like fseek and returns 0 on success.  tell returns
+ * the current position, or -1 on error.  seek and tell can be NULL for a
+ * stream which cannot seek.
+ */
+typedef struct ByteIOCallbacks {
+    int (*read)(void *opaque, void *buf, int size);
+    int (*seek)(void *opaque, int64_t offset, int whence);
+    int64_t (*tell)(void *opaque);
+} ByteIOCallbacks;
+
+/**
+ * Memory allocator, with the same functions as FlakeAllocator
+ * alloc returns a block of at least size bytes, aligned for any type, or
+ * NULL if it fails.  free releases a block returned by alloc, and is never
+ * called with NULL.  Both are called from the thread reading the stream.
+ */
+typedef struct ByteIOAllocator {
+    void *(*alloc)(void *opaque, size_t size);
+    void (*free)(void *opaque, void *ptr);
+    void *opaque;
+} ByteIOAllocator;
+
+struct ByteIOReadAhead;
+
 typedef struct ByteIOContext {
-    FILE *fp;
+    const ByteIOCallbacks *cb;  ///< NULL for a memory buffer
+    void *opaque;
     unsigned char *buffer;
     int index;
     int size;
+    const unsigned char *map;   ///< whole input, if mapped or in memory
+    uint64_t map_size;
+    uint64_t map_pos;
+    int mapped;                 ///< map is from mmap() and must be unmapped
+    int seekable;
+    uint64_t file_size;         ///< 0 if unknown
+    struct ByteIOReadAhead *ra; ///< background reader, if enabled
+    ByteIOAllocator allocator;  ///< all NULL for malloc and free
+    size_t mem_current;         ///< bytes allocated now
+    size_t mem_peak;            ///< most bytes allocated at once
 } ByteIOContext;
 
+/**
+ * Read from a stdio stream, starting at the beginning of the file if it is
+ * seekable.  Seekable regular files are memory-mapped when the system
+ * supports it.
+ */
 extern int byteio_init(ByteIOContext *ctx, FILE *fp);
 
+/**
+ * Read from a file descriptor, like byteio_init()
+ */
+extern int byteio_init_fd(ByteIOContext *ctx, int fd);
+
+/**
+ * Read from a buffer in memory, which is not copied.  It must stay valid
+ * until byteio_close().
+ */
+extern int byteio_init_mem(ByteIOContext *ctx, const void *data,
+                           uint64_t size);
+
+/**
+ * Read through user functions, starting at the current position if the
+ * stream cannot seek, or at position 0 if it can.
+ */
+extern int byteio_init_callbacks(ByteIOContext *ctx,
+                                 const ByteIOCallbacks *cb, void *opaque);
+
+/**
+ * Read the stream ahead in a background thread, into the given number of
+ * chunks of chunk_size bytes.  0 selects the default for either.  A stream
+ * which cannot seek is read at most BYTEIO_BUFFER_SIZE bytes at a time, so
+ * that data from a pipe is not held back.  Input in memory or memory-mapped
+ * is left as it is.
+ * Returns -1 if threads are not supported or on error.
+ */
+extern int byteio_set_read_ahead(ByteIOContext *ctx, int chunk_size,
+                                 int chunks);
+
+/**
+ * Allocate memory through the allocator of the context, and count it
+ * Returns NULL on error.
+ */
+extern void *byteio_alloc(ByteIOContext *ctx, size_t size);
+
+/**
+ * Free memory from byteio_alloc(), which can be NULL
+ */
+extern void byteio_free(ByteIOContext *ctx, void *ptr);
+
+/**
+ * Allocate all further memory through the given functions, which are
+ * copied, or through malloc and free if allocator is NULL.  The input buffer
+ * is moved to the new allocator.  Must be called before
+ * byteio_set_read_ahead().
+ */
+extern int byteio_set_allocator(ByteIOContext *ctx,
+                                const ByteIOAllocator *allocator);
+
 extern void byteio_align(ByteIOContext *ctx);
 
 extern int byteio_flush(ByteIOContext *ctx);
@@ -46,6 +145,25 @@ extern int byteio_read(void *ptr, int n, ByteIOContext *ctx);
 
 extern int byteio_peek(void *ptr, int n, ByteIOContext *ctx);
 
+/**
+ * Returns a pointer to the next n bytes of a memory-mapped file or memory
+ * buffer in *data, and skips them.  Returns the number of bytes available,
+ * or -1 if the input is not in memory.
+ */
+extern int byteio_read_direct(const unsigned char **data, int n,
+                              ByteIOContext *ctx);
+
+/**
+ * Moves to an absolute position.  Returns -1 if the input cannot seek, and
+ * the position is then unchanged.
+ */
+extern int byteio_seek(ByteIOContext *ctx, uint64_t pos);
+
+/**
+ * Returns 1 if the context has input to read from
+ */
+extern int byteio_is_open(const ByteIOContext *ctx);
+
 extern void byteio_close(ByteIOContext *ctx);
 
 #endif /* BYTEIO_H */
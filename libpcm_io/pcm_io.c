@@ -41,88 +41,43 @@
 int
 pcmfile_seek_set(PcmFile *pf, uint64_t dest)
 {
-    FILE *fp = pf->io.fp;
-    int slow_seek = !(pf->seekable);
-
-    if(pf->seekable) {
-        if(dest <= INT32_MAX) {
-            // destination is within first 2GB
-            if(fseek(fp, (long)dest, SEEK_SET)) return -1;
-        } else {
-            int64_t offset = (int64_t)dest - (int64_t)pf->filepos;
-            if(offset >= INT32_MIN && offset <= INT32_MAX) {
-                // offset is within +/- 2GB of file start
-                if(fseek(fp, (long)offset, SEEK_CUR)) return -1;
-            } else {
-                // absolute offset is more than 2GB
-                if(offset < 0) {
-                    fprintf(stderr, "error: backward seeking is limited to 2GB\n");
-                    return -1;
-                } else {
-                    fprintf(stderr, "warning: forward seeking more than 2GB will be slow.\n");
-                }
-                slow_seek = 1;
-            }
-        }
-        byteio_flush(&pf->io);
-    }
-    if(slow_seek) {
-        // do forward-only seek by reading data to temp buffer
+    // do a forward-only seek by reading data to a temp buffer if the input
+    // cannot seek
+    if(!pf->seekable || byteio_seek(&pf->io, dest)) {
         uint64_t offset;
-        uint8_t buf[1024];
+        uint8_t buf[BYTEIO_BUFFER_SIZE];
+        int n, nr;
 
         if(dest < pf->filepos)
             return -1;
 
-        for(offset = dest - pf->filepos; offset > 1024; offset -= 1024)
-            byteio_read(buf, 1024, &pf->io);
-
-        byteio_read(buf, offset, &pf->io);
+        for(offset = dest - pf->filepos; offset > 0; offset -= n) {
+            n = (int)MIN(offset, BYTEIO_BUFFER_SIZE);
+            nr = byteio_read(buf, n, &pf->io);
+            if(nr != n) {
+                // stopped at the end of the stream
+                pf->filepos = dest - offset + MAX(nr, 0);
+                return -1;
+            }
+        }
     }
     pf->filepos = dest;
 
     return 0;
 }
 
-int
-pcmfile_init(PcmFile *pf, FILE *fp, enum PcmDataFormat read_format,
-             int file_format)
+/**
+ * Detect the file format if not given and read the header.  The byte
+ * input must be set up.
+ */
+static int
+pcmfile_open(PcmFile *pf, enum PcmDataFormat read_format, int file_format)
 {
-    if(pf == NULL || fp == NULL) {
-        fprintf(stderr, "null input to pcmfile_init()\n");
-        return -1;
-    }
-
-    memset(pf, 0, sizeof(PcmFile));
     pf->file_format = file_format;
     pf->read_format = read_format;
-
-    // attempt to get file size
-#ifdef _WIN32
-    // in Windows, don't try to detect seeking support for stdin
-    if(fp != stdin) {
-        pf->seekable = !fseek(fp, 0, SEEK_END);
-    }
-#else
-    pf->seekable = !fseek(fp, 0, SEEK_END);
-#endif
-    if(pf->seekable) {
-        // TODO: portable 64-bit ftell
-        long fs = ftell(fp);
-        // ftell should return an error if value cannot fit in return type
-        if(fs < 0) {
-            fprintf(stderr, "Warning, unsupported file size.\n");
-            pf->file_size = 0;
-        } else {
-            pf->file_size = (uint64_t)fs;
-        }
-        fseek(fp, 0, SEEK_SET);
-    }
+    pf->seekable = pf->io.seekable;
+    pf->file_size = pf->io.file_size;
     pf->filepos = 0;
-    if(byteio_init(&pf->io, fp)) {
-        fprintf(stderr, "error initializing byte buffer\n");
-        return -1;
-    }
 
     // detect file format if not specified by the user
     pcmfile_register_all_formats();
@@ -146,6 +101,98 @@ pcmfile_init(PcmFile *pf, FILE *fp, enum PcmDataFormat read_format,
     return 0;
 }
 
+int
+pcmfile_init(PcmFile *pf, FILE *fp, enum PcmDataFormat read_format,
+             int file_format)
+{
+    if(pf == NULL || fp == NULL) {
+        fprintf(stderr, "null input to pcmfile_init()\n");
+        return -1;
+    }
+
+    memset(pf, 0, sizeof(PcmFile));
+    if(byteio_init(&pf->io, fp)) {
+        fprintf(stderr, "error initializing byte buffer\n");
+        return -1;
+    }
+    return pcmfile_open(pf, read_format, file_format);
+}
+
+int
+pcmfile_init_fd(PcmFile *pf, int fd, enum PcmDataFormat read_format,
+                int file_format)
+{
+    if(pf == NULL || fd < 0) {
+        fprintf(stderr, "invalid input to pcmfile_init_fd()\n");
+        return -1;
+    }
+
+    memset(pf, 0, sizeof(PcmFile));
+    if(byteio_init_fd(&pf->io, fd)) {
+        fprintf(stderr, "error initializing byte buffer\n");
+        return -1;
+    }
+    return pcmfile_open(pf, read_format, file_format);
+}
+
+int
+pcmfile_init_mem(PcmFile *pf, const void *data, uint64_t size,
+                 enum PcmDataFormat read_format, int file_format)
+{
+    if(pf == NULL || data == NULL) {
+        fprintf(stderr, "null input to pcmfile_init_mem()\n");
+        return -1;
+    }
+
+    memset(pf, 0, sizeof(PcmFile));
+    if(byteio_init_mem(&pf->io, data, size))
+        return -1;
+    return pcmfile_open(pf, read_format, file_format);
+}
+
+int
+pcmfile_init_callbacks(PcmFile *pf, const ByteIOCallbacks *cb, void *opaque,
+                       enum PcmDataFormat read_format, int file_format)
+{
+    if(pf == NULL || cb == NULL || cb->read == NULL) {
+        fprintf(stderr, "null input to pcmfile_init_callbacks()\n");
+        return -1;
+    }
+
+    memset(pf, 0, sizeof(PcmFile));
+    if(byteio_init_callbacks(&pf->io, cb, opaque)) {
+        fprintf(stderr, "error initializing byte buffer\n");
+        return -1;
+    }
+    return pcmfile_open(pf, read_format, file_format);
+}
+
+int
+pcmfile_set_read_ahead(PcmFile *pf, int chunk_size, int chunks)
+{
+    if(pf == NULL || !byteio_is_open(&pf->io))
+        return -1;
+    return byteio_set_read_ahead(&pf->io, chunk_size, chunks);
+}
+
+int
+pcmfile_set_allocator(PcmFile *pf, const ByteIOAllocator *allocator)
+{
+    if(pf == NULL || !byteio_is_open(&pf->io))
+        return -1;
+    return byteio_set_allocator(&pf->io, allocator);
+}
+
+int
+pcmfile_get_memory_usage(const PcmFile *pf, size_t *current, size_t *peak)
+{
+    if(pf == NULL)
+        return -1;
+    if(current) *current = pf->io.mem_current;
+    if(peak) *peak = pf->io.mem_peak;
+    return 0;
+}
+
 void
 pcmfile_close(PcmFile *pf)
 {
@@ -156,12 +203,13 @@ int
 pcmfile_read_samples(PcmFile *pf, void *output, int num_samples)
 {
     uint8_t *buffer;
-    uint8_t *read_buffer;
+    const uint8_t *read_buffer;
+    void *src;
     uint32_t bytes_needed, buffer_size;
-    int nr, i, j, bps, nsmp;
+    int nr, i, j, bps, nsmp, swap;
 
     // check input and limit number of samples
-    if(pf == NULL || pf->io.fp == NULL || output == NULL || pf->fmt_convert == NULL) {
+    if(pf == NULL || !byteio_is_open(&pf->io) || output == NULL || pf->fmt_convert == NULL) {
         fprintf(stderr, "null input to pcmfile_read_samples()\n");
         return -1;
     }
@@ -182,20 +230,42 @@ pcmfile_read_samples(PcmFile *pf, void *output, int num_samples)
     }
     if(num_samples <= 0) return 0;
 
-    // allocate temporary buffer for raw input data
+    // a memory-mapped file is converted straight from the mapped pages when
+    // the samples need no byte swapping or unpacking.  otherwise, they are
+    // swapped or unpacked from the pages into a temporary buffer.
     bps = pf->block_align / pf->channels;
-    buffer_size = (bps != 3) ? bytes_needed : num_samples * sizeof(int32_t) * pf->channels;
-    buffer = calloc(buffer_size+1, 1);
-    if(!buffer) {
-        fprintf(stderr, "error allocating read buffer\n");
-        return -1;
+#ifdef WORDS_BIGENDIAN
+    swap = (pf->order == PCM_BYTE_ORDER_LE && bps > 1);
+#else
+    swap = (pf->order == PCM_BYTE_ORDER_BE && bps > 1);
+#endif
+    buffer = NULL;
+    src = NULL;
+    nr = 0;
+    if(pf->io.map) {
+        nr = byteio_read_direct(&read_buffer, bytes_needed, &pf->io);
+        if(!swap && bps != 3 && !((uintptr_t)read_buffer % bps))
+            src = (void *)read_buffer;
     }
-    read_buffer = buffer + (buffer_size - bytes_needed);
 
-    // read raw audio samples from input stream into temporary buffer
-    nr = byteio_read(read_buffer, bytes_needed, &pf->io);
+    // allocate temporary buffer for raw input data
+    buffer_size = (bps != 3) ? bytes_needed : num_samples * sizeof(int32_t) * pf->channels;
+    if(!src) {
+        buffer = byteio_alloc(&pf->io, buffer_size+1);
+        if(!buffer) {
+            fprintf(stderr, "error allocating read buffer\n");
+            return -1;
+        }
+        memset(buffer, 0, buffer_size+1);
+    }
+    if(!pf->io.map) {
+        // read raw audio samples from input stream into temporary buffer
+        uint8_t *raw = buffer + (buffer_size - bytes_needed);
+        nr = byteio_read(raw, bytes_needed, &pf->io);
+        read_buffer = raw;
+    }
     if (nr <= 0) {
-        free(buffer);
+        byteio_free(&pf->io, buffer);
         return nr;
     }
     pf->filepos += nr;
@@ -205,73 +275,80 @@ pcmfile_read_samples(PcmFile *pf, void *output, int num_samples)
     // do any necessary conversion based on source_format and read_format.
     // also do byte swapping when necessary based on source audio and system
     // byte orders.
-    switch (bps) {
-    case 2:
-#ifdef WORDS_BIGENDIAN
-        if(pf->order == PCM_BYTE_ORDER_LE)
-#else
-        if(pf->order == PCM_BYTE_ORDER_BE)
-#endif
-        {
-            uint16_t *buf16 = (uint16_t *)buffer;
-            for(i=0; i<nsmp; i++) {
-                buf16[i] = bswap_16(buf16[i]);
+    if(!src) {
+        src = buffer;
+        switch (bps) {
+        case 1:
+            if(read_buffer != buffer)
+                memcpy(buffer, read_buffer, nsmp);
+            break;
+        case 2:
+            {
+                uint16_t *buf16 = (uint16_t *)buffer;
+                if(read_buffer != buffer)
+                    memcpy(buffer, read_buffer, nsmp * 2);
+                if(swap) {
+                    for(i=0; i<nsmp; i++) {
+                        buf16[i] = bswap_16(buf16[i]);
+                    }
+                }
             }
-        }
-        break;
-    case 3:
-        {
-            int32_t *input = (int32_t*)buffer;
-            int unused_bits = 32 - pf->bit_width;
-            int32_t v;
-            for(i=0,j=0; i<nsmp*bps; i+=bps,j++) {
-#ifdef WORDS_BIGENDIAN
-                if(pf->order == PCM_BYTE_ORDER_LE)
-#else
-                if(pf->order == PCM_BYTE_ORDER_BE)
-#endif
-                {
-                    v = be2me_32((*(int32_t*)(read_buffer + i)) << 8);
-                } else {
-                    v = *(int32_t*)(read_buffer + i);
+            break;
+        case 3:
+            {
+                int32_t *input = (int32_t*)buffer;
+                const uint8_t *p = read_buffer;
+                int unused_bits = 32 - pf->bit_width;
+                int big_endian = (pf->order == PCM_BYTE_ORDER_BE);
+                int32_t v;
+                for(i=0,j=0; i<nsmp*bps; i+=bps,j++) {
+                    // unpack bytewise, which needs no byte order swap and
+                    // does not read past the last sample
+                    if(big_endian) {
+                        v = (int32_t)(((uint32_t)p[i] << 24) |
+                                      ((uint32_t)p[i+1] << 16) |
+                                      ((uint32_t)p[i+2] << 8)) >> 8;
+                    } else {
+                        v = (int32_t)(((uint32_t)p[i+2] << 24) |
+                                      ((uint32_t)p[i+1] << 16) |
+                                      ((uint32_t)p[i] << 8)) >> 8;
+                    }
+                    v <<= unused_bits; // clear unused high bits
+                    v >>= unused_bits; // sign extend
+                    input[j] = v;
                 }
-                v <<= unused_bits; // clear unused high bits
-                v >>= unused_bits; // sign extend
-                input[j] = v;
             }
-        }
-        break;
-    case 4:
-#ifdef WORDS_BIGENDIAN
-        if(pf->order == PCM_BYTE_ORDER_LE)
-#else
-        if(pf->order == PCM_BYTE_ORDER_BE)
-#endif
-        {
-            uint32_t *buf32 = (uint32_t *)buffer;
-            for(i=0; i<nsmp; i++) {
-                buf32[i] = bswap_32(buf32[i]);
+            break;
+        case 4:
+            {
+                uint32_t *buf32 = (uint32_t *)buffer;
+                if(read_buffer != buffer)
+                    memcpy(buffer, read_buffer, nsmp * 4);
+                if(swap) {
+                    for(i=0; i<nsmp; i++) {
+                        buf32[i] = bswap_32(buf32[i]);
+                    }
+                }
             }
-        }
-        break;
-    default:
-#ifdef WORDS_BIGENDIAN
-        if(pf->order == PCM_BYTE_ORDER_LE)
-#else
-        if(pf->order == PCM_BYTE_ORDER_BE)
-#endif
-        {
-            uint64_t *buf64 = (uint64_t *)buffer;
-            for(i=0; i<nsmp; i++) {
-                buf64[i] = bswap_64(buf64[i]);
+            break;
+        default:
+            {
+                uint64_t *buf64 = (uint64_t *)buffer;
+                if(read_buffer != buffer)
+                    memcpy(buffer, read_buffer, nsmp * 8);
+                if(swap) {
+                    for(i=0; i<nsmp; i++) {
+                        buf64[i] = bswap_64(buf64[i]);
+                    }
+                }
             }
+            break;
         }
-        break;
     }
-    pf->fmt_convert(output, buffer, nsmp);
+    pf->fmt_convert(output, src, nsmp);
 
     // free temporary buffer
-    free(buffer);
+    byteio_free(&pf->io, buffer);
 
     return nr;
 }
@@ -282,7 +359,7 @@ pcmfile_seek_samples(PcmFile *pf, int64_t offset, int whence)
     int64_t byte_offset;
     uint64_t newpos, fpos, dst, dsz;
 
-    if(pf == NULL || pf->io.fp == NULL) return -1;
+    if(pf == NULL || !byteio_is_open(&pf->io)) return -1;
     if(pf->block_align <= 0) return -1;
     if(pf->filepos < pf->data_start) return -1;
     if(pf->data_size == 0) return 0;
@@ -91,7 +91,8 @@ enum PcmFileFormat {
     PCM_FORMAT_UNKNOWN = -1,
     PCM_FORMAT_RAW     =  0,
     PCM_FORMAT_WAVE    =  1,
-    PCM_FORMAT_AIFF    =  2
+    PCM_FORMAT_AIFF    =  2,
+    PCM_FORMAT_W64     =  3
 };
 
 /* byte orders */
@@ -140,6 +141,53 @@ typedef struct PcmFile {
  */
 extern int pcmfile_init(PcmFile *pf, FILE *fp, enum PcmDataFormat read_format, int file_format);
 
+/**
+ * Initializes PcmFile structure to read from a file descriptor.
+ * Otherwise the same as pcmfile_init().
+ */
+extern int pcmfile_init_fd(PcmFile *pf, int fd, enum PcmDataFormat read_format, int file_format);
+
+/**
+ * Initializes PcmFile structure to read a file held in memory.  The data
+ * is read in place, without a copy, and must stay valid until
+ * pcmfile_close().  Otherwise the same as pcmfile_init().
+ */
+extern int pcmfile_init_mem(PcmFile *pf, const void *data, uint64_t size,
+                            enum PcmDataFormat read_format, int file_format);
+
+/**
+ * Initializes PcmFile structure to read through user functions.  If seek
+ * and tell are given, reading starts at position 0.  Otherwise the same as
+ * pcmfile_init().
+ */
+extern int pcmfile_init_callbacks(PcmFile *pf, const ByteIOCallbacks *cb,
+                                  void *opaque, enum PcmDataFormat read_format,
+                                  int file_format);
+
+/**
+ * Reads the rest of the input ahead in a background thread.  The arguments
+ * are those of byteio_set_read_ahead().
+ */
+extern int pcmfile_set_read_ahead(PcmFile *pf, int chunk_size, int chunks);
+
+/**
+ * Allocates the memory of pf through the given functions, which are copied,
+ * or through malloc and free if allocator is NULL.  Call it after one of the
+ * init functions, which allocate the input buffer with malloc, and before
+ * pcmfile_set_read_ahead().  The input buffer is moved to the allocator.
+ */
+extern int pcmfile_set_allocator(PcmFile *pf, const ByteIOAllocator *allocator);
+
+/**
+ * Gets the memory used by pf, in bytes requested from its allocator.
+ * current is the memory allocated now, and peak the most allocated at once
+ * since init, including the buffers used while reading.  A memory-mapped
+ * input file is not counted.  Either pointer can be NULL.
+ * Returns -1 on error, 0 otherwise.
+ */
+extern int pcmfile_get_memory_usage(const PcmFile *pf, size_t *current,
+                                    size_t *peak);
+
 /**
  * Frees memory from internal buffer.
  */
@@ -171,8 +219,8 @@ extern int pcmfile_read_samples(PcmFile *pf, void *buffer, int num_samples);
 
 /**
  * Seeks to byte offset within file.
- * Limits the seek position or offset to signed 32-bit.
- * It also does slower forward seeking for streaming input.
+ * It does slower forward seeking by reading for streaming input, or when
+ * the input cannot seek to the offset.
  */
 extern int pcmfile_seek_set(PcmFile *pf, uint64_t dest);
 
@@ -19,19 +19,49 @@
 
 /**
  * @file wav.c
- * WAV file format
+ * WAV file format, including RF64 and Sony Wave64
  */
 
+
+#include <string.h>
+
 #include "bswap.h"
 #include "pcm_io_common.h"
 #include "pcm_io.h"
 
 /* chunk id's */
 #define RIFF_ID     0x46464952
+#define RF64_ID     0x34364652
+#define BW64_ID     0x34365742
 #define WAVE_ID     0x45564157
+#define DS64_ID     0x34367364
 #define FMT__ID     0x20746D66
 #define DATA_ID     0x61746164
 
+/* RF64 chunk size which means the size is in the ds64 chunk */
+#define RF64_SIZE_IN_DS64 0xFFFFFFFF
+
+/**
+ * Wave64 chunk GUIDs.  Apart from riff, they all end the same way, and the
+ * first 4 bytes name the chunk, as in WAVE.
+ */
+#define W64_WAVE_ID 0x65766177
+static const uint8_t w64_riff_guid[16] = {
+    'r', 'i', 'f', 'f', 0x2E, 0x91, 0xCF, 0x11,
+    0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0x00, 0x00
+};
+static const uint8_t w64_guid_tail[12] = {
+    0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A
+};
+
+/** audio parameters from the fmt chunk */
+typedef struct WaveFmt {
+    int tag;
+    int channels;
+    int sample_rate;
+    int bits;
+} WaveFmt;
+
 /**
  * Reads a 4-byte little-endian word from the input stream
  */
@@ -45,6 +75,16 @@ read4le(PcmFile *pf)
     return le2me_32(x);
 }
 
+/**
+ * Reads an 8-byte little-endian word from the input stream
+ */
+static inline uint64_t
+read8le(PcmFile *pf)
+{
+    uint64_t lo = read4le(pf);
+    return lo | ((uint64_t)read4le(pf) << 32);
+}
+
 /**
  * Reads a 2-byte little-endian word from the input stream
  */
@@ -58,6 +98,108 @@ read2le(PcmFile *pf)
     return le2me_16(x);
 }
 
+/**
+ * Reads the fmt chunk contents, which are the same in all WAVE variants.
+ * Returns the number of bytes read, or -1 if the format is invalid.
+ */
+static int
+read_fmt(PcmFile *pf, uint64_t chunksize, WaveFmt *fmt)
+{
+    int len = 16;
+
+    if(chunksize < 16) {
+        fprintf(stderr, "invalid fmt chunk in wav header\n");
+        return -1;
+    }
+    fmt->tag = read2le(pf);
+    fmt->channels = read2le(pf);
+    fmt->sample_rate = read4le(pf);
+    pf->wav_bps = read4le(pf);
+    read2le(pf);    // block align is recalculated from the bit depth
+    fmt->bits = read2le(pf);
+
+    // WAVE_FORMAT_EXTENSIBLE data
+    pf->ch_mask = 0;
+    if(fmt->tag == WAVE_FORMAT_EXTENSIBLE && chunksize >= 26) {
+        read4le(pf);    // skip CbSize and ValidBitsPerSample
+        pf->ch_mask = read4le(pf);
+        fmt->tag = read2le(pf);
+        len += 10;
+    }
+
+    // check header params
+    if(fmt->tag != WAVE_FORMAT_PCM) {
+        fprintf(stderr, "unsupported wFormatTag: 0x%02X\n", fmt->tag);
+        return -1;
+    }
+    if(fmt->channels == 0) {
+        fprintf(stderr, "invalid number of channels in wav header\n");
+        return -1;
+    }
+    if(fmt->sample_rate == 0) {
+        fprintf(stderr, "invalid sample rate in wav header\n");
+        return -1;
+    }
+    if(fmt->bits == 0) {
+        fprintf(stderr, "invalid sample bit width in wav header\n");
+        return -1;
+    }
+
+    // use default channel mask if necessary
+    if(pf->ch_mask == 0) {
+        pf->ch_mask = pcmfile_get_default_ch_mask(fmt->channels);
+    }
+    return len;
+}
+
+/**
+ * Sets the data position and size at the start of the data chunk.  A size
+ * of 0 means the data runs to the end of the file.
+ */
+static void
+set_data_chunk(PcmFile *pf, const WaveFmt *fmt, uint64_t size)
+{
+    // override block alignment in header
+    int block_align = MAX(1, ((fmt->bits + 7) >> 3) * fmt->channels);
+
+    if(size == 0)
+        pf->read_to_eof = 1;
+    pf->data_size = size;
+    pf->data_start = pf->filepos;
+    if(pf->seekable && pf->file_size > 0) {
+        // limit data size to end-of-file
+        if(pf->data_size > 0)
+            pf->data_size = MIN(pf->data_size, pf->file_size - pf->data_start);
+        else
+            pf->data_size = pf->file_size - pf->data_start;
+    }
+    pf->samples = (pf->data_size / block_align);
+}
+
+/**
+ * Sets the audio data format based on bit depth and sample type
+ */
+static int
+set_wave_params(PcmFile *pf, const WaveFmt *fmt)
+{
+    enum PcmSampleFormat sfmt;
+
+    switch(fmt->bits) {
+        case 8:  sfmt = PCM_SAMPLE_FMT_U8;  break;
+        case 16: sfmt = PCM_SAMPLE_FMT_S16; break;
+        case 20: sfmt = PCM_SAMPLE_FMT_S20; break;
+        case 24: sfmt = PCM_SAMPLE_FMT_S24; break;
+        case 32: sfmt = PCM_SAMPLE_FMT_S32; break;
+        default:
+            fprintf(stderr, "unsupported bit depth: %d\n", fmt->bits);
+            return -1;
+    }
+    pf->internal_fmt = fmt->tag;
+    pcmfile_set_source_params(pf, fmt->channels, sfmt, PCM_BYTE_ORDER_LE,
+                              fmt->sample_rate);
+    return 0;
+}
+
 static int
 wave_probe(uint8_t *data, int size)
 {
@@ -66,7 +208,7 @@ wave_probe(uint8_t *data, int size)
     if(!data || size < 12)
         return 0;
     id = data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
-    if(id != RIFF_ID) {
+    if(id != RIFF_ID && id != RF64_ID && id != BW64_ID) {
         return 0;
     }
     id = data[8] | (data[9] << 8) | (data[10] << 16) | (data[11] << 24);
@@ -79,19 +221,21 @@ wave_probe(uint8_t *data, int size)
 static int
 wave_init(PcmFile *pf)
 {
-    int id, found_data, found_fmt, chunksize;
-    int tag=1, channels=2, sample_rate=44100, block_align=4, bits=16;
-    enum PcmSampleFormat fmt = PCM_SAMPLE_FMT_S16;
+    int id, found_data, found_fmt, rf64, len;
+    uint32_t chunksize;
+    uint64_t size, ds64_data_size = 0;
+    WaveFmt fmt;
 
     // read RIFF id. ignore size.
     id = read4le(pf);
-    if(id != RIFF_ID) {
+    if(id != RIFF_ID && id != RF64_ID && id != BW64_ID) {
         fprintf(stderr, "invalid RIFF id in wav header\n");
         return -1;
     }
+    rf64 = (id != RIFF_ID);
     read4le(pf);
 
-    // read WAVE id. ignore size.
+    // read WAVE id
     id = read4le(pf);
     if(id != WAVE_ID) {
         fprintf(stderr, "invalid WAVE id in wav header\n");
@@ -103,54 +247,31 @@ wave_init(PcmFile *pf)
     while(!found_data) {
         id = read4le(pf);
         chunksize = read4le(pf);
+        if(!id) {
+            fprintf(stderr, "no data chunk in wav file\n");
+            return -1;
+        }
         switch(id) {
-            case FMT__ID:
+            case DS64_ID:
+                // 64-bit sizes for RF64.  ignore RIFF size and sample count.
                 if(chunksize < 16) {
-                    fprintf(stderr, "invalid fmt chunk in wav header\n");
+                    fprintf(stderr, "invalid ds64 chunk in wav header\n");
                     return -1;
                 }
-                tag = read2le(pf);
-                channels = read2le(pf);
-                sample_rate = read4le(pf);
-                pf->wav_bps = read4le(pf);
-                block_align = read2le(pf);
-                bits = read2le(pf);
+                read8le(pf);
+                ds64_data_size = read8le(pf);
                 chunksize -= 16;
-
-                // WAVE_FORMAT_EXTENSIBLE data
-                pf->ch_mask = 0;
-                if(tag == WAVE_FORMAT_EXTENSIBLE && chunksize >= 10) {
-                    read4le(pf);    // skip CbSize and ValidBitsPerSample
-                    pf->ch_mask = read4le(pf);
-                    tag = read2le(pf);
-                    chunksize -= 10;
-                }
-
-                // check header params
-                if(tag != WAVE_FORMAT_PCM) {
-                    fprintf(stderr, "unsupported wFormatTag: 0x%02X\n", tag);
-                    return -1;
-                }
-                if(channels == 0) {
-                    fprintf(stderr, "invalid number of channels in wav header\n");
-                    return -1;
-                }
-                if(sample_rate == 0) {
-                    fprintf(stderr, "invalid sample rate in wav header\n");
+                chunksize += chunksize & 1;
+                if(chunksize > 0 && pcmfile_seek_set(pf, pf->filepos + chunksize)) {
+                    fprintf(stderr, "error seeking in wav file\n");
                     return -1;
                 }
-                if(bits == 0) {
-                    fprintf(stderr, "invalid sample bit width in wav header\n");
+                break;
+            case FMT__ID:
+                len = read_fmt(pf, chunksize, &fmt);
+                if(len < 0)
                     return -1;
-                }
-
-                // override block alignment in header
-                block_align = MAX(1, ((bits + 7) >> 3) * channels);
-
-                // use default channel mask if necessary
-                if(pf->ch_mask == 0) {
-                    pf->ch_mask = pcmfile_get_default_ch_mask(channels);
-                }
+                chunksize -= len;
 
                 // skip any leftover bytes in fmt chunk
                 chunksize += chunksize & 1;
@@ -162,18 +283,12 @@ wave_init(PcmFile *pf)
                 break;
             case DATA_ID:
                 if(!found_fmt) return -1;
-                if(chunksize == 0)
-                    pf->read_to_eof = 1;
-                pf->data_size = chunksize;
-                pf->data_start = pf->filepos;
-                if(pf->seekable && pf->file_size > 0) {
-                    // limit data size to end-of-file
-                    if(pf->data_size > 0)
-                        pf->data_size = MIN(pf->data_size, pf->file_size - pf->data_start);
-                    else
-                        pf->data_size = pf->file_size - pf->data_start;
+                size = chunksize;
+                if(chunksize == RF64_SIZE_IN_DS64) {
+                    // the size is in ds64, or is unknown for streamed RIFF
+                    size = rf64 ? ds64_data_size : 0;
                 }
-                pf->samples = (pf->data_size / block_align);
+                set_data_chunk(pf, &fmt, size);
                 found_data = 1;
                 break;
             default:
@@ -186,24 +301,7 @@ wave_init(PcmFile *pf)
         }
     }
 
-    // set audio data format based on bit depth and sample type
-    fmt = PCM_SAMPLE_FMT_UNKNOWN;
-    switch(bits) {
-        case 8:  fmt = PCM_SAMPLE_FMT_U8;  break;
-        case 16: fmt = PCM_SAMPLE_FMT_S16; break;
-        case 20: fmt = PCM_SAMPLE_FMT_S20; break;
-        case 24: fmt = PCM_SAMPLE_FMT_S24; break;
-        case 32:
-                fmt = PCM_SAMPLE_FMT_S32;
-            break;
-        default:
-            fprintf(stderr, "unsupported bit depth: %d\n", bits);
-            return -1;
-    }
-    pf->internal_fmt = tag;
-    pcmfile_set_source_params(pf, channels, fmt, PCM_BYTE_ORDER_LE, sample_rate);
-
-    return 0;
+    return set_wave_params(pf, &fmt);
 }
 
 PcmFormat wave_format = {
@@ -214,3 +312,111 @@ PcmFormat wave_format = {
     wave_init,
     NULL
 };
+
+/**
+ * Reads a Wave64 GUID.  Returns the chunk id from its first 4 bytes, or 0
+ * if it is not a Wave64 chunk GUID.
+ */
+static int
+read_w64_guid(PcmFile *pf)
+{
+    uint8_t guid[16];
+
+    if(byteio_read(guid, 16, &pf->io) != 16)
+        return 0;
+    pf->filepos += 16;
+    if(memcmp(&guid[4], w64_guid_tail, 12))
+        return 0;
+    return guid[0] | (guid[1] << 8) | (guid[2] << 16) | (guid[3] << 24);
+}
+
+static int
+w64_probe(uint8_t *data, int size)
+{
+    if(!data || size < 12)
+        return 0;
+    if(memcmp(data, w64_riff_guid, 12))
+        return 0;
+    return 100;
+}
+
+/**
+ * Wave64 has the same fmt and data chunks as WAVE, with GUID chunk ids and
+ * 64-bit chunk sizes which include the 24-byte chunk header.  Chunks are
+ * aligned to 8 bytes.
+ */
+static int
+w64_init(PcmFile *pf)
+{
+    int id, found_data, found_fmt, len;
+    uint8_t guid[16];
+    uint64_t chunksize;
+    WaveFmt fmt;
+
+    // read riff GUID. ignore size.
+    if(byteio_read(guid, 16, &pf->io) != 16 ||
+            memcmp(guid, w64_riff_guid, 16)) {
+        fprintf(stderr, "invalid riff GUID in w64 header\n");
+        return -1;
+    }
+    pf->filepos += 16;
+    read8le(pf);
+
+    // read wave GUID
+    if(read_w64_guid(pf) != W64_WAVE_ID) {
+        fprintf(stderr, "invalid wave GUID in w64 header\n");
+        return -1;
+    }
+
+    // read all header chunks. skip unknown chunks.
+    found_data = found_fmt = 0;
+    while(!found_data) {
+        id = read_w64_guid(pf);
+        chunksize = read8le(pf);
+        if(chunksize < 24) {
+            fprintf(stderr, "no data chunk in w64 file\n");
+            return -1;
+        }
+        chunksize -= 24;
+        switch(id) {
+            case FMT__ID:
+                len = read_fmt(pf, chunksize, &fmt);
+                if(len < 0)
+                    return -1;
+
+                // skip any leftover bytes in fmt chunk, up to the 8-byte
+                // alignment of the whole chunk
+                chunksize += (8 - (chunksize & 7)) & 7;
+                chunksize -= len;
+                if(pcmfile_seek_set(pf, pf->filepos + chunksize)) {
+                    fprintf(stderr, "error seeking in w64 file\n");
+                    return -1;
+                }
+                found_fmt = 1;
+                break;
+            case DATA_ID:
+                if(!found_fmt) return -1;
+                set_data_chunk(pf, &fmt, chunksize);
+                found_data = 1;
+                break;
+            default:
+                // skip unknown chunk
+                chunksize += (8 - (chunksize & 7)) & 7;
+                if(chunksize > 0 && pcmfile_seek_set(pf, pf->filepos + chunksize)) {
+                    fprintf(stderr, "error seeking in w64 file\n");
+                    return -1;
+                }
+        }
+    }
+
+    return set_wave_params(pf, &fmt);
+}
+
+PcmFormat w64_format = {
+    "w64",
+    "Sony Wave64",
+    PCM_FORMAT_W64,
+    w64_probe,
+    w64_init,
+    NULL
+};
@@ -178,7 +178,9 @@ main(int argc, char **argv)
     if(open_files(argc, argv))
         return 1;
 
-    // read audio info from WAVE header
+    // read audio info from WAVE header.  fields left at zero, such as the
+    // allocator, use their defaults.
+    memset(&s, 0, sizeof(FlakeContext));
     if(parse_wav_header(&s)) {
         fprintf(stderr, "error opening WAVE file\n");
         return 1;
@@ -213,7 +215,7 @@ main(int argc, char **argv)
     percent_complete = 0.0f;
     num_samples = read_samples(&s, input_samples, s.params.block_size);
     while(num_samples > 0) {
-        frame_bytes = flake_encode_frame(&s, input_samples, num_samples);
+        frame_bytes = flake_encode_frame_s16(&s, input_samples, num_samples);
         if(frame_bytes < 0) {
             fprintf(stderr, "\nError encoding frame\n");
         } else if(frame_bytes > 0) {
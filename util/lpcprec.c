@@ -0,0 +1,155 @@
+/**
+ * LPC Analysis Precision Comparison Utility
+ * Encodes each input file with double and single-precision LPC analysis and
+ * reports how many frames differ and the difference in encoded size.
+ *
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * Flake is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Flake is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Flake; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "common.h"
+
+#include "pcm_io.h"
+#include "flake.h"
+
+typedef struct PrecStats {
+    int frames;
+    int diff_frames;
+    uint64_t bytes[2];
+} PrecStats;
+
+static void
+print_stats(const char *name, const PrecStats *st)
+{
+    double delta = 0.0;
+
+    if(st->bytes[0] > 0) {
+        delta = 100.0 * ((double)st->bytes[1] - (double)st->bytes[0]) /
+                (double)st->bytes[0];
+    }
+    printf("%-24s frames: %6d | differ: %6d (%6.2f%%) | "
+           "double: %10"PRIu64" | single: %10"PRIu64" | delta: %+.4f%%\n",
+           name, st->frames, st->diff_frames,
+           st->frames ? (100.0 * st->diff_frames / st->frames) : 0.0,
+           st->bytes[0], st->bytes[1], delta);
+}
+
+static int
+compare_file(const char *fname, int compr, PrecStats *st)
+{
+    FILE *fp;
+    PcmFile pf;
+    FlakeContext s[2];
+    uint8_t *frame[2];
+    int32_t *wav;
+    int i, nr, fs[2];
+
+    fp = fopen(fname, "rb");
+    if(!fp) {
+        fprintf(stderr, "cannot open file: %s\n", fname);
+        return -1;
+    }
+    if(pcmfile_init(&pf, fp, (enum PcmDataFormat)PCM_SAMPLE_FMT_S32,
+                    PCM_FORMAT_UNKNOWN)) {
+        fprintf(stderr, "invalid input file: %s\n", fname);
+        fclose(fp);
+        return -1;
+    }
+
+    for(i=0; i<2; i++) {
+        memset(&s[i], 0, sizeof(FlakeContext));
+        s[i].channels = pf.channels;
+        s[i].sample_rate = pf.sample_rate;
+        s[i].bits_per_sample = pf.bit_width;
+        s[i].samples = pf.samples;
+        s[i].params.compression = compr;
+        if(flake_set_defaults(&s[i].params)) {
+            fprintf(stderr, "invalid compression level: %d\n", compr);
+            pcmfile_close(&pf);
+            fclose(fp);
+            return -1;
+        }
+        s[i].params.float_analysis = i;
+        if(flake_encode_init(&s[i]) < 0) {
+            fprintf(stderr, "error initializing encoder: %s\n", fname);
+            if(i) flake_encode_close(&s[0]);
+            flake_encode_close(&s[i]);
+            pcmfile_close(&pf);
+            fclose(fp);
+            return -1;
+        }
+        frame[i] = flake_get_buffer(&s[i]);
+    }
+
+    memset(st, 0, sizeof(PrecStats));
+    wav = malloc(s[0].params.block_size * s[0].channels * sizeof(int32_t));
+    nr = pcmfile_read_samples(&pf, wav, s[0].params.block_size);
+    while(nr > 0) {
+        fs[0] = flake_encode_frame(&s[0], wav, nr);
+        fs[1] = flake_encode_frame(&s[1], wav, nr);
+        if(fs[0] < 0 || fs[1] < 0) {
+            fprintf(stderr, "error encoding frame: %s\n", fname);
+            break;
+        }
+        st->frames++;
+        if(fs[0] != fs[1] || memcmp(frame[0], frame[1], fs[0]))
+            st->diff_frames++;
+        st->bytes[0] += fs[0];
+        st->bytes[1] += fs[1];
+        nr = pcmfile_read_samples(&pf, wav, s[0].params.block_size);
+    }
+
+    free(wav);
+    flake_encode_close(&s[0]);
+    flake_encode_close(&s[1]);
+    pcmfile_close(&pf);
+    fclose(fp);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int i, compr, files;
+    PrecStats st, total;
+
+    if(argc < 2) {
+        fprintf(stderr, "\nusage: lpcprec [-0 ... -12] in1.wav [in2.wav ...]\n\n");
+        return 1;
+    }
+
+    compr = 5;
+    files = 0;
+    memset(&total, 0, sizeof(PrecStats));
+    for(i=1; i<argc; i++) {
+        if(argv[i][0] == '-' && argv[i][1] >= '0' && argv[i][1] <= '9') {
+            compr = atoi(&argv[i][1]);
+            continue;
+        }
+        if(compare_file(argv[i], compr, &st))
+            continue;
+        print_stats(argv[i], &st);
+        total.frames += st.frames;
+        total.diff_frames += st.diff_frames;
+        total.bytes[0] += st.bytes[0];
+        total.bytes[1] += st.bytes[1];
+        files++;
+    }
+    if(files > 1)
+        print_stats("total", &total);
+
+    return 0;
+}
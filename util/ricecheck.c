@@ -0,0 +1,307 @@
+/**
+ * Rice Parameter Search Check
+ * Compares the closed-form Rice parameter and pruned partition order
+ * searches with exhaustive searches over generated residuals, and reports
+ * any case where they differ.
+ *
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * Flake is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Flake is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Flake; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "common.h"
+
+#include "rice.h"
+
+static uint32_t rand_state = 1;
+
+static uint32_t
+rand_u32(void)
+{
+    rand_state = rand_state * 1664525 + 1013904223;
+    return rand_state;
+}
+
+static const int block_sizes[] = {
+    1, 2, 3, 5, 16, 17, 192, 256, 576, 1152, 2304, 4096, 4608, 8192, 16384,
+    32768, 65535
+};
+#define NUM_BLOCK_SIZES (int)(sizeof(block_sizes) / sizeof(block_sizes[0]))
+
+/**
+ * Rice parameter search which tests every parameter.  The bit count is kept
+ * to 32 bits, as in the encoder.
+ */
+static int
+find_optimal_rice_param_full(uint64_t sum, int n)
+{
+    int k, k_opt;
+    uint32_t nbits[MAX_RICE_PARAM+1];
+
+    k_opt = 0;
+    nbits[0] = UINT32_MAX;
+    for(k=0; k<=MAX_RICE_PARAM; k++) {
+        nbits[k] = rice_encode_count(sum, n, k);
+        if(nbits[k] < nbits[k_opt])
+            k_opt = k;
+    }
+    return k_opt;
+}
+
+/**
+ * Check find_optimal_rice_param against testing every parameter, for sums
+ * around each point where the best parameter can change and along a
+ * geometric sweep of the average sum per sample.
+ */
+static int
+check_rice_param(uint64_t *count)
+{
+    int i, j, k, n, errors;
+    uint64_t sum, base;
+
+    errors = 0;
+    for(i=0; i<NUM_BLOCK_SIZES; i++) {
+        n = block_sizes[i];
+        for(j=0; j<7096; j++) {
+            // dense near 0, then growing by about 1% per step
+            if(j < 4096)
+                sum = j;
+            else
+                sum = (uint64_t)(4096.0 * pow(1.01, j - 4096));
+            for(k=-2; k<=2; k++) {
+                uint64_t s = sum + k;
+                if((int64_t)s < 0)
+                    continue;
+                (*count)++;
+                if(find_optimal_rice_param(s, n) !=
+                   find_optimal_rice_param_full(s, n)) {
+                    if(errors++ < 10)
+                        fprintf(stderr, "rice param: n=%d sum=%"PRIu64
+                                " closed form %d, full %d\n", n, s,
+                                find_optimal_rice_param(s, n),
+                                find_optimal_rice_param_full(s, n));
+                }
+            }
+        }
+        // the first minimum moves at ((sum - n/2) >> k) == 2*n
+        for(k=0; k<=MAX_RICE_PARAM+1; k++) {
+            base = ((2 * (uint64_t)n) << k) + (n >> 1);
+            for(j=-3; j<=3; j++) {
+                sum = base + j;
+                (*count)++;
+                if(find_optimal_rice_param(sum, n) !=
+                   find_optimal_rice_param_full(sum, n)) {
+                    if(errors++ < 10)
+                        fprintf(stderr, "rice param: n=%d sum=%"PRIu64
+                                " closed form %d, full %d\n", n, sum,
+                                find_optimal_rice_param(sum, n),
+                                find_optimal_rice_param_full(sum, n));
+                }
+            }
+        }
+    }
+    return errors;
+}
+
+/**
+ * Highest partition order allowed by the block size and prediction order
+ */
+static int
+limit_porder(int porder, int n, int order)
+{
+    while(porder > 0 && (n % (1 << porder) || (n >> porder) < order))
+        porder--;
+    return porder;
+}
+
+/**
+ * Rice parameters and residual bit count for one partition order, summing
+ * each partition from the residual
+ */
+static uint32_t
+calc_porder_bits(RiceContext *rc, int porder, const int32_t *data, int n,
+                 int pred_order)
+{
+    int i, j, k, start, end, cnt;
+    uint64_t sum;
+    uint32_t bits;
+
+    rc->method = ENCODING_METHOD_RICE;
+    rc->porder = porder;
+    bits = 0;
+    for(i=0; i<(1 << porder); i++) {
+        start = i ? i * (n >> porder) : pred_order;
+        end = (i+1) * (n >> porder);
+        sum = 0;
+        for(j=start; j<end; j++)
+            sum += (uint32_t)((2*data[j]) ^ (data[j]>>31));
+        cnt = end - start;
+        k = find_optimal_rice_param_full(sum, cnt);
+        rc->params[i] = k;
+        if(k > MAX_RICE_PARAM_4BIT)
+            rc->method = ENCODING_METHOD_RICE2;
+        bits += rice_encode_count(sum, cnt, k) + 4;
+    }
+    return bits;
+}
+
+/**
+ * Fixed prediction subframe bit count found by evaluating every partition
+ * order from pmin to pmax, as done before the search was pruned.  Ties go to
+ * the higher partition order.
+ */
+static uint32_t
+calc_rice_params_full(RiceContext *rc, int pmin, int pmax, int32_t *data,
+                      int n, int pred_order, int bps)
+{
+    int i;
+    uint32_t bits, opt_bits;
+    RiceContext tmp_rc;
+
+    pmin = limit_porder(pmin, n, pred_order);
+    pmax = limit_porder(pmax, n, pred_order);
+    opt_bits = UINT32_MAX;
+    for(i=pmin; i<=pmax; i++) {
+        bits = calc_porder_bits(&tmp_rc, i, data, n, pred_order);
+        if(bits <= opt_bits) {
+            opt_bits = bits;
+            *rc = tmp_rc;
+        }
+    }
+    return pred_order*bps + 2 + opt_bits + rc->method + 4;
+}
+
+static int
+same_rice_params(const RiceContext *a, const RiceContext *b)
+{
+    return a->method == b->method && a->porder == b->porder &&
+           !memcmp(a->params, b->params,
+                   (1 << a->porder) * sizeof(a->params[0]));
+}
+
+/**
+ * Fill a block with Laplacian-like residual.  The scale changes within the
+ * block so that different partition orders win, and some blocks are large
+ * enough for the partition sums to exceed 32 bits.
+ */
+static void
+gen_residual(int32_t *res, int n)
+{
+    int i, shift, seg;
+
+    shift = rand_u32() % 31;
+    seg = 1 + rand_u32() % n;
+    for(i=0; i<n; i++) {
+        int32_t v;
+        if(i % seg == 0 && (rand_u32() & 1)) {
+            shift += (int)(rand_u32() % 9) - 4;
+            shift = CLIP(shift, 0, 30);
+        }
+        v = (int32_t)((rand_u32() & ((2u << shift) - 1)) >> 1);
+        v >>= rand_u32() % (shift + 1);
+        res[i] = (rand_u32() & 1) ? -v : v;
+    }
+}
+
+/**
+ * Check the pruned partition order search and the bound calculated partition
+ * by partition against the full search.
+ */
+static int
+check_partition_search(int blocks, uint64_t *count)
+{
+    int b, i, n, order, pmin, pmax, psize, errors;
+    int32_t *res;
+    uint32_t bits_full, bits;
+    RiceContext rc_full, rc;
+    RiceBound rb;
+
+    res = malloc(65535 * sizeof(int32_t));
+    if(!res)
+        return 1;
+
+    errors = 0;
+    for(b=0; b<blocks; b++) {
+        n = block_sizes[4 + rand_u32() % (NUM_BLOCK_SIZES-4)];
+        order = rand_u32() % 33;
+        if(order >= n)
+            order = 0;
+        pmax = rand_u32() % (MAX_PARTITION_ORDER+1);
+        pmin = rand_u32() % (pmax+1);
+        gen_residual(res, n);
+
+        bits_full = calc_rice_params_full(&rc_full, pmin, pmax, res, n,
+                                          order, 16);
+        (*count)++;
+        bits = calc_rice_params_fixed(&rc, pmin, pmax, res, n, order, 16);
+        if(bits != bits_full || !same_rice_params(&rc, &rc_full)) {
+            if(errors++ < 10)
+                fprintf(stderr, "partition search: n=%d order=%d porder "
+                        "%d-%d: pruned %u bits at porder %d, full %u bits at "
+                        "porder %d\n", n, order, pmin, pmax, bits,
+                        rc.porder, bits_full, rc_full.porder);
+        }
+
+        // the bound must give the same result as calc_rice_params_lpc
+        (*count)++;
+        bits_full = calc_rice_params_lpc(&rc_full, pmin, pmax, res, n, order,
+                                         16, 15);
+        rice_bound_init_lpc(&rb, pmin, pmax, n, order, 16, 15);
+        psize = n >> rb.pmax;
+        for(i=0; i<(1 << rb.pmax); i++) {
+            int start = i ? i*psize : order;
+            rice_bound_add_partition(&rb, &res[start], (i+1)*psize - start);
+        }
+        bits = rice_bound_finish(&rb, &rc);
+        if(bits != bits_full || !same_rice_params(&rc, &rc_full)) {
+            if(errors++ < 10)
+                fprintf(stderr, "rice bound: n=%d order=%d porder %d-%d: "
+                        "%u bits, calc_rice_params_lpc %u bits\n", n, order,
+                        pmin, pmax, bits, bits_full);
+        }
+    }
+
+    free(res);
+    return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+    int blocks, errors, perr;
+    uint64_t count;
+
+    blocks = 20000;
+    if(argc > 1)
+        blocks = atoi(argv[1]);
+    if(argc > 2)
+        rand_state = atoi(argv[2]);
+    if(argc > 3 || blocks <= 0) {
+        fprintf(stderr, "\nusage: ricecheck [blocks [seed]]\n\n");
+        return 1;
+    }
+
+    count = 0;
+    errors = check_rice_param(&count);
+    printf("rice parameter:   %10"PRIu64" sums checked, %d differ\n", count,
+           errors);
+
+    count = 0;
+    perr = check_partition_search(blocks, &count);
+    printf("partition search: %10"PRIu64" searches checked, %d differ\n",
+           count, perr);
+
+    return (errors || perr) ? 1 : 0;
+}
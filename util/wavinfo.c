@@ -274,7 +274,8 @@ static void
 wavinfo_print(WavInfo *wi)
 {
     char *type;
-    int samples, leftover;
+    uint64_t samples;
+    int64_t leftover;
     float playtime;
     PcmFile *wf = &wi->wf;
 
@@ -302,7 +303,7 @@ wavinfo_print(WavInfo *wi)
     printf("Data:\n");
     printf("   Start:         %"PRIu64"\n", wf->data_start);
     printf("   Data Size:     %"PRIu64"\n", wf->data_size);
-    leftover = wf->file_size - wf->data_size - wf->data_start;
+    leftover = (int64_t)(wf->file_size - wf->data_size - wf->data_start);
     if(leftover < 0) {
         if(!wf->seekable) {
             printf("   [ warning! unable to verify true data size ]\n");
@@ -310,12 +311,12 @@ wavinfo_print(WavInfo *wi)
             printf("   [ warning! reported data size is larger than file size ]\n");
         }
     } else if(leftover > 0) {
-        printf("   Leftover:  %d bytes\n", leftover);
+        printf("   Leftover:  %"PRId64" bytes\n", leftover);
     }
     if(wf->internal_fmt == 0x0001 || wf->internal_fmt == 0x0003) {
         samples = wf->data_size / wf->block_align;
         playtime = (float)samples / (float)wf->sample_rate;
-        printf("   Samples:       %d\n", samples);
+        printf("   Samples:       %"PRIu64"\n", samples);
         printf("   Playing Time:  %0.2f sec\n", playtime);
     } else {
         printf("   Samples:       unknown\n");